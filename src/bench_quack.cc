@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cli11.hh"
+#include "quack.hh"
+#include "quack_decoder.hh"
+#include "sidekick_protocol.hh"
+
+// Microbenchmarks for the quACK math, reported as JSON so runs can be compared between releases
+
+namespace {
+
+// Keeps the compiler from optimizing away results that are otherwise unused
+volatile uint32_t sink;
+
+struct Result
+{
+  std::string name;
+  size_t threshold;
+  size_t window;
+  size_t missing;
+  double ns_per_op;
+};
+
+class Bench
+{
+private:
+  std::chrono::duration<double> min_time_;
+  std::vector<Result> results_ {};
+
+public:
+  explicit Bench( std::chrono::duration<double> min_time ) : min_time_( min_time ) {}
+
+  // Runs `body` (which performs `ops_per_call` operations) until `min_time_` has passed, and records ns/op
+  template<typename F>
+  void run( const std::string& name, size_t threshold, size_t window, size_t missing, size_t ops_per_call, F&& body )
+  {
+    // Warm up caches and lazily allocated state before timing
+    body();
+
+    size_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed {};
+    do {
+      body();
+      calls++;
+      elapsed = std::chrono::steady_clock::now() - start;
+    } while ( elapsed < min_time_ );
+
+    double ns_per_op = elapsed.count() * 1e9 / ( calls * ops_per_call );
+    results_.push_back( { name, threshold, window, missing, ns_per_op } );
+    std::cerr << name << " threshold=" << threshold << " window=" << window << " missing=" << missing << ": "
+              << ns_per_op << " ns/op" << std::endl;
+  }
+
+  void write_json( std::ostream& out ) const
+  {
+    out << "{\n  \"benchmarks\": [";
+    for ( size_t i = 0; i < results_.size(); i++ ) {
+      const auto& r = results_[i];
+      out << ( i ? "," : "" ) << "\n    { \"name\": \"" << r.name << "\", \"threshold\": " << r.threshold
+          << ", \"window\": " << r.window << ", \"missing\": " << r.missing << ", \"ns_per_op\": " << r.ns_per_op
+          << " }";
+    }
+    out << "\n  ]\n}" << std::endl;
+  }
+};
+
+std::vector<uint32_t> random_ids( std::mt19937& eng, size_t count )
+{
+  std::vector<uint32_t> ids( count );
+  for ( auto& id : ids ) {
+    id = eng();
+  }
+  return ids;
+}
+
+// add_batch() takes a SIMD path on CPUs that have one, which must agree with add() one id at a time for every
+// threshold and batch size, including those that aren't a multiple of the vector width
+void check_add_batch( std::mt19937& eng )
+{
+  for ( size_t threshold : { 1, 2, 3, 4, 5, 7, 8, 13, 32, 33, 127 } ) {
+    for ( size_t batch_size : { 1, 3, 4, 5, 63, 64, 65, 130 } ) {
+      // With repeats, which count once, and ids at or above the modulus, which wrap around
+      auto ids = random_ids( eng, 1000 );
+      for ( size_t i = 17; i < ids.size(); i += 17 ) {
+        ids[i] = ids[i / 2];
+      }
+      ids[1] = UINT32_MAX;
+      ids[2] = QUACK_MODULUS;
+      ids[3] = QUACK_MODULUS + 1;
+
+      PowerSums single( threshold );
+      for ( auto id : ids ) {
+        single.add( id );
+      }
+      PowerSums batched( threshold );
+      for ( size_t i = 0; i < ids.size(); i += batch_size ) {
+        batched.add_batch( std::span<const uint32_t>( ids ).subspan( i, std::min( batch_size, ids.size() - i ) ) );
+      }
+
+      bool same = single.count() == batched.count();
+      for ( size_t i = 0; i < threshold; i++ ) {
+        same = same && single[i] == batched[i];
+      }
+      if ( !same ) {
+        throw std::runtime_error( "add_batch() disagrees with add() at threshold " + std::to_string( threshold )
+                                  + ", batch size " + std::to_string( batch_size ) );
+      }
+    }
+  }
+}
+
+// A quACK held back by the budget keeps taking in ids. Its id list must stay bounded and give way to power sums,
+// even if the threshold adapts up meanwhile, and start over once the quACK finally goes out.
+void check_deferred_quack( std::mt19937& eng )
+{
+  static constexpr size_t MAX_SUMS = 16;
+  auto expect = []( bool ok, const std::string& what ) {
+    if ( !ok ) {
+      throw std::runtime_error( "Deferred quACK check failed: " + what );
+    }
+  };
+
+  Quack quack;
+  quack.threshold = 8;
+  quack.num_sums = 8;
+  quack.power_sums = PowerSums( MAX_SUMS );
+  auto fold = [&]( std::span<const uint32_t> ids ) {
+    quack.power_sums.add_batch( ids );
+    quack.num_received = quack.power_sums.count();
+    quack.last_received_id = ids.back();
+    quack.add_received_ids( ids, MAX_SUMS );
+    quack.choose_encoding();
+  };
+
+  auto ids = random_ids( eng, 1000 );
+  fold( std::span<const uint32_t>( ids ).first( 3 ) );
+  expect( quack.encoding == QuackEncoding::IdList, "a short list isn't sent as one" );
+
+  for ( size_t i = 3; i < ids.size(); i += 50 ) {
+    fold( std::span<const uint32_t>( ids ).subspan( i, std::min<size_t>( 50, ids.size() - i ) ) );
+  }
+  expect( quack.received_ids.size() == MAX_SUMS, "the list grew past the most sums" );
+  expect( quack.encoding == QuackEncoding::PowerSums, "a long list isn't sent as power sums" );
+
+  quack.threshold = MAX_SUMS;
+  quack.num_sums = MAX_SUMS;
+  quack.choose_encoding();
+  expect( quack.encoding == QuackEncoding::PowerSums, "raising the threshold brought back a cut-short list" );
+
+  FixedSerializer<MAX_QUACK_SIZE> serializer;
+  quack.serialize( serializer );
+  Quack sent;
+  expect( parse( sent, { std::string( serializer.output() ) } ), "the quACK doesn't parse" );
+  expect( sent.encoding == QuackEncoding::PowerSums && sent.num_sums == MAX_SUMS
+            && sent.num_received == quack.num_received,
+          "the quACK doesn't parse back the same" );
+
+  quack.mark_sent();
+  expect( quack.received_ids.empty() && quack.list_base_count == quack.num_received,
+          "the list didn't start over once sent" );
+  fold( std::span<const uint32_t>( random_ids( eng, 2 ) ) );
+  expect( quack.encoding == QuackEncoding::IdList && quack.received_ids.size() == 2,
+          "the next quACK isn't a list of what came since" );
+}
+
+// A quACK without any power sums can't be decoded against, so it must not parse
+void check_zero_threshold()
+{
+  Quack quack;
+  quack.threshold = 0;
+  quack.num_sums = 0;
+  FixedSerializer<MAX_QUACK_SIZE> serializer;
+  quack.serialize( serializer );
+
+  Quack parsed;
+  if ( parse( parsed, { std::string( serializer.output() ) } ) ) {
+    throw std::runtime_error( "A quACK with threshold 0 parsed" );
+  }
+}
+
+// Operations on a single set of power sums, independent of how many packets were lost
+void bench_power_sums( Bench& bench, size_t threshold, std::mt19937& eng )
+{
+  static constexpr size_t NUM_IDS = 1 << 12;
+  static constexpr size_t BATCH_SIZE = 64;
+
+  auto ids = random_ids( eng, NUM_IDS );
+  PowerSums sums( threshold );
+
+  bench.run( "add", threshold, 0, 0, NUM_IDS, [&] {
+    sums.clear();
+    for ( auto id : ids ) {
+      sums.add( id );
+    }
+  } );
+
+  bench.run( "add_batch", threshold, BATCH_SIZE, 0, NUM_IDS, [&] {
+    sums.clear();
+    for ( size_t i = 0; i < ids.size(); i += BATCH_SIZE ) {
+      sums.add_batch( std::span<const uint32_t>( ids ).subspan( i, BATCH_SIZE ) );
+    }
+  } );
+
+  // Removing only works for ids still within the duplicate horizon, so add and remove the same few
+  auto recent = std::span<const uint32_t>( ids ).first( BATCH_SIZE );
+  bench.run( "add_remove", threshold, 0, 0, recent.size(), [&] {
+    for ( auto id : recent ) {
+      sums.add( id );
+    }
+    for ( auto id : recent ) {
+      sums.remove( id );
+    }
+  } );
+
+  PowerSums other( threshold );
+  PowerSums difference( threshold );
+  other.add_batch( recent );
+  bench.run( "difference", threshold, 0, 0, 1, [&] {
+    sums.difference( other, difference );
+    sink = difference[0].value();
+  } );
+
+  std::vector<QuackInt> inverses( threshold + 1 );
+  for ( size_t i = 1; i <= threshold; i++ ) {
+    inverses[i] = QuackInt( i ).inverse();
+  }
+
+  Polynomial polynomial( threshold );
+  bench.run( "newton", threshold, 0, 0, 1, [&] {
+    polynomial.assign( difference, threshold, inverses );
+    sink = polynomial.eval( 1 ).value();
+  } );
+
+  bench.run( "eval", threshold, 0, 0, NUM_IDS, [&] {
+    uint32_t acc = 0;
+    for ( auto id : ids ) {
+      acc += polynomial.eval( id ).value();
+    }
+    sink = acc;
+  } );
+
+  std::unique_ptr<bool[]> is_root( new bool[NUM_IDS] );
+  bench.run( "eval_many", threshold, 0, 0, NUM_IDS, [&] {
+    polynomial.eval_many( ids, { is_root.get(), NUM_IDS } );
+    sink = is_root[0];
+  } );
+}
+
+// Sender and proxy sums over `window` ids, `missing` of which the proxy never saw, decoded from scratch
+void bench_decode( Bench& bench, size_t threshold, size_t window, size_t missing, std::mt19937& eng )
+{
+  auto ids = random_ids( eng, window );
+
+  PowerSums sent( threshold );
+  sent.add_batch( ids );
+
+  Quack quack;
+  quack.threshold = threshold;
+  quack.num_sums = threshold;
+  quack.power_sums = PowerSums( threshold );
+  quack.power_sums.add_batch( std::span<const uint32_t>( ids ).subspan( missing ) );
+  quack.num_received = quack.power_sums.count();
+
+  QuackDecoder decoder( threshold );
+  bench.run( "decode", threshold, window, missing, 1, [&] {
+    auto result = decoder.decode( sent, quack, ids );
+    if ( !result.has_value() || result->size() != missing ) {
+      throw std::runtime_error( "decode benchmark found the wrong missing ids" );
+    }
+  } );
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+  CLI::App app;
+
+  std::vector<size_t> thresholds = { 8, 16, 32, 64, 128, 256 };
+  std::vector<size_t> windows = { 64, 256, 1024 };
+  double min_time_ms = 50;
+  std::string output_path = "";
+  bool check_only = false;
+
+  app.add_option( "-t,--thresholds", thresholds, "Missing packet thresholds to measure" )->capture_default_str();
+  app.add_option( "-w,--windows", windows, "Number of ids per decoded quACK" )->capture_default_str();
+  app.add_option( "-m,--min-time", min_time_ms, "Minimum time to run each benchmark for in milliseconds" )
+    ->capture_default_str();
+  app.add_option( "-o,--output", output_path, "File to write JSON results to, otherwise stdout" );
+  app.add_flag( "--check", check_only, "Only run the correctness checks, not the benchmarks" );
+
+  CLI11_PARSE( app, argc, argv );
+
+  std::mt19937 eng { 244 };
+  check_add_batch( eng );
+  check_deferred_quack( eng );
+  check_zero_threshold();
+  if ( check_only ) {
+    return EXIT_SUCCESS;
+  }
+
+  Bench bench { std::chrono::duration<double, std::milli>( min_time_ms ) };
+
+  for ( size_t threshold : thresholds ) {
+    bench_power_sums( bench, threshold, eng );
+
+    for ( size_t window : windows ) {
+      // No losses, a single loss, and half and all of what the threshold can solve for
+      for ( size_t missing : { size_t { 0 }, size_t { 1 }, threshold / 2, threshold } ) {
+        if ( missing <= window ) {
+          bench_decode( bench, threshold, window, missing, eng );
+        }
+      }
+    }
+  }
+
+  if ( output_path.empty() ) {
+    bench.write_json( std::cout );
+  } else {
+    std::ofstream output( output_path );
+    bench.write_json( output );
+  }
+
+  return EXIT_SUCCESS;
+}
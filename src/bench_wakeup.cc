@@ -0,0 +1,184 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch_queue.hh"
+#include "cli11.hh"
+#include "histogram.hh"
+#include "runtime.hh"
+#include "socket.hh"
+
+// Measures how long a thread blocked on a batch_queue or a UDP socket takes to notice a message, with the runtime
+// options off and then on, and reports both latency distributions as JSON
+
+namespace {
+
+struct Result
+{
+  std::string name;
+  std::string mode;
+  Histogram latency;
+};
+
+uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() )
+    .count();
+}
+
+// Runs `consume` and `produce` on their own threads, with the runtime options applied to both if `runtime` is set.
+// The producer leaves `gap` between messages, so the consumer has time to go back to sleep before each one.
+template<typename Produce, typename Consume>
+void run_pair( const Runtime* runtime, Produce&& produce, Consume&& consume )
+{
+  std::thread consumer( [&] {
+    if ( runtime ) {
+      runtime->enter_thread( "consumer" );
+    }
+    consume();
+  } );
+  std::thread producer( [&] {
+    if ( runtime ) {
+      runtime->enter_thread( "producer" );
+    }
+    produce();
+  } );
+  producer.join();
+  consumer.join();
+}
+
+Histogram bench_queue( const Runtime* runtime,
+                       std::chrono::steady_clock::duration spin,
+                       size_t messages,
+                       std::chrono::microseconds gap )
+{
+  batch_queue<uint64_t> queue;
+  queue.set_spin( spin );
+  Histogram latency;
+
+  run_pair(
+    runtime,
+    [&] {
+      std::vector<uint64_t> batch;
+      for ( size_t i = 0; i < messages; i++ ) {
+        std::this_thread::sleep_for( gap );
+        batch.push_back( now_ns() );
+        queue.push( batch );
+      }
+    },
+    [&] {
+      std::vector<uint64_t> batch;
+      for ( size_t received = 0; received < messages; ) {
+        queue.pop_all( batch );
+        uint64_t woke_at = now_ns();
+        for ( auto sent_at : batch ) {
+          latency.record( woke_at - sent_at );
+        }
+        received += batch.size();
+      }
+    } );
+  return latency;
+}
+
+Histogram bench_socket( const Runtime* runtime,
+                        std::chrono::steady_clock::duration spin,
+                        size_t messages,
+                        std::chrono::microseconds gap,
+                        uint16_t port )
+{
+  Address address( "127.0.0.1", port );
+  UDPSocket receiver;
+  receiver.bind( address );
+  receiver.set_spin( spin );
+  if ( runtime ) {
+    receiver.set_busy_poll( runtime->busy_poll() );
+  }
+  UDPSocket sender;
+  Histogram latency;
+
+  run_pair(
+    runtime,
+    [&] {
+      for ( size_t i = 0; i < messages; i++ ) {
+        std::this_thread::sleep_for( gap );
+        uint64_t sent_at = now_ns();
+        sender.sendto( { reinterpret_cast<const char*>( &sent_at ), sizeof( sent_at ) }, address );
+      }
+    },
+    [&] {
+      std::string payload;
+      for ( size_t i = 0; i < messages; i++ ) {
+        receiver.recvfrom( payload );
+        uint64_t woke_at = now_ns();
+        uint64_t sent_at;
+        memcpy( &sent_at, payload.data(), sizeof( sent_at ) );
+        latency.record( woke_at - sent_at );
+      }
+    } );
+  return latency;
+}
+
+void write_json( std::ostream& out, const std::vector<Result>& results )
+{
+  out << "{\n  \"benchmarks\": [";
+  for ( size_t i = 0; i < results.size(); i++ ) {
+    const auto& r = results[i];
+    out << ( i ? "," : "" ) << "\n    { \"name\": \"" << r.name << "\", \"mode\": \"" << r.mode
+        << "\", \"p50_ns\": " << r.latency.percentile( 50 ) << ", \"p90_ns\": " << r.latency.percentile( 90 )
+        << ", \"p99_ns\": " << r.latency.percentile( 99 ) << ", \"p999_ns\": " << r.latency.percentile( 99.9 )
+        << ", \"max_ns\": " << r.latency.max() << " }";
+  }
+  out << "\n  ]\n}" << std::endl;
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+  CLI::App app;
+
+  size_t messages = 10000;
+  uint64_t gap_us = 200;
+  uint16_t port = 9555;
+  std::string output_path = "";
+
+  app.add_option( "-n,--messages", messages, "Messages to time in each run" )->capture_default_str();
+  app.add_option( "-g,--gap", gap_us, "Microseconds between messages" )->capture_default_str();
+  app.add_option( "-p,--port", port, "Loopback port for the socket benchmark" )->capture_default_str();
+  app.add_option( "-o,--output", output_path, "File to write JSON results to, otherwise stdout" );
+
+  // Without --spin-us, the on runs spin for twice the gap, so that they never sleep
+  Runtime runtime;
+  runtime.add_options( app, "producer, consumer" );
+
+  CLI11_PARSE( app, argc, argv );
+  runtime.start();
+
+  auto gap = std::chrono::microseconds( gap_us );
+  std::chrono::steady_clock::duration spin = runtime.spin().count() > 0 ? runtime.spin() : 2 * gap;
+
+  std::vector<Result> results;
+  auto record = [&]( const std::string& name, const std::string& mode, Histogram latency ) {
+    std::cerr << name << " " << mode << ": p50 " << latency.percentile( 50 ) << " ns, p99 "
+              << latency.percentile( 99 ) << " ns, max " << latency.max() << " ns" << std::endl;
+    results.push_back( { name, mode, latency } );
+  };
+
+  record( "queue", "off", bench_queue( nullptr, {}, messages, gap ) );
+  record( "queue", "on", bench_queue( &runtime, spin, messages, gap ) );
+  record( "socket", "off", bench_socket( nullptr, {}, messages, gap, port ) );
+  record( "socket", "on", bench_socket( &runtime, spin, messages, gap, port ) );
+
+  if ( output_path.empty() ) {
+    write_json( std::cout, results );
+  } else {
+    std::ofstream output( output_path );
+    write_json( output, results );
+  }
+
+  return EXIT_SUCCESS;
+}
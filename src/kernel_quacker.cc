@@ -0,0 +1,171 @@
+#include "kernel_quacker.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <net/if.h>
+
+#include "log.hh"
+#include "sidekick_protocol.hh"
+
+static_assert( QUACK_BPF_MODULUS == QUACK_MODULUS && QUACK_BPF_ID_OFFSET == QUACK_ID_OFFSET );
+static_assert( sizeof( quack_bpf_sums ) % 8 == 0, "per-CPU map values are read 8-byte aligned" );
+
+KernelQuacker::KernelQuacker( const std::string& interface,
+                              const std::string& object_path,
+                              uint16_t dst_port,
+                              size_t quacking_packet_interval,
+                              size_t num_power_sums,
+                              Handler on_quack )
+  : interface_( interface ), on_quack_( std::move( on_quack ) )
+{
+  if ( num_power_sums > QUACK_BPF_MAX_THRESHOLD ) {
+    throw std::runtime_error( "The eBPF program keeps at most " + std::to_string( QUACK_BPF_MAX_THRESHOLD )
+                              + " power sums" );
+  }
+
+  if ( ( ifindex_ = if_nametoindex( interface.c_str() ) ) == 0 ) {
+    throw std::runtime_error( "Unknown interface " + interface );
+  }
+
+  object_ = bpf_object__open_file( object_path.c_str(), NULL );
+  if ( object_ == NULL ) {
+    throw std::runtime_error( "Unable to open eBPF object " + object_path );
+  }
+  if ( bpf_object__load( object_ ) < 0 ) {
+    throw std::runtime_error( "Unable to load eBPF object " + object_path );
+  }
+
+  int program_fd = bpf_program__fd( bpf_object__find_program_by_name( object_, "quack_ingress" ) );
+  sums_fd_ = bpf_object__find_map_fd_by_name( object_, "quack_sums" );
+  int config_fd = bpf_object__find_map_fd_by_name( object_, "quack_config" );
+  int events_fd = bpf_object__find_map_fd_by_name( object_, "quack_events" );
+  insert_failures_fd_ = bpf_object__find_map_fd_by_name( object_, "quack_insert_failures" );
+  if ( program_fd < 0 || sums_fd_ < 0 || config_fd < 0 || events_fd < 0 || insert_failures_fd_ < 0 ) {
+    throw std::runtime_error( "eBPF object " + object_path + " is missing the quACK program or maps" );
+  }
+
+  // Configure before attaching, so the program never runs with a zeroed config
+  uint32_t zero = 0;
+  quack_bpf_config config { .threshold = static_cast<uint32_t>( num_power_sums ),
+                            .interval = static_cast<uint32_t>( quacking_packet_interval ),
+                            .dst_port = dst_port,
+                            .pad = 0 };
+  if ( bpf_map_update_elem( config_fd, &zero, &config, BPF_ANY ) < 0 ) {
+    throw std::runtime_error( "Unable to configure eBPF program" );
+  }
+
+  events_ = ring_buffer__new( events_fd, handle_event, this, NULL );
+  if ( events_ == NULL ) {
+    throw std::runtime_error( "Unable to open eBPF ring buffer" );
+  }
+
+  int num_cpus = libbpf_num_possible_cpus();
+  if ( num_cpus <= 0 ) {
+    throw std::runtime_error( "Unable to count possible CPUs" );
+  }
+  per_cpu_sums_.resize( num_cpus );
+  per_cpu_insert_failures_.resize( num_cpus );
+  sums_.resize( num_power_sums );
+
+  // The clsact qdisc may already be there from an earlier run
+  DECLARE_LIBBPF_OPTS( bpf_tc_hook, hook, .ifindex = ifindex_, .attach_point = BPF_TC_INGRESS );
+  int err = bpf_tc_hook_create( &hook );
+  if ( err < 0 && err != -EEXIST ) {
+    throw std::runtime_error( "Unable to create tc hook on " + interface );
+  }
+
+  DECLARE_LIBBPF_OPTS( bpf_tc_opts, opts, .prog_fd = program_fd );
+  if ( bpf_tc_attach( &hook, &opts ) < 0 ) {
+    throw std::runtime_error( "Unable to attach eBPF program to " + interface );
+  }
+}
+
+KernelQuacker::~KernelQuacker()
+{
+  DECLARE_LIBBPF_OPTS( bpf_tc_hook, hook, .ifindex = ifindex_, .attach_point = BPF_TC_INGRESS );
+  bpf_tc_hook_destroy( &hook );
+
+  if ( events_ ) {
+    ring_buffer__free( events_ );
+  }
+  if ( object_ ) {
+    bpf_object__close( object_ );
+  }
+}
+
+void KernelQuacker::run()
+{
+  LOG_INFO( "KernelQuacker started, counting packets on interface ", interface_ );
+  while ( true ) {
+    int err = ring_buffer__poll( events_, -1 );
+    if ( err < 0 && err != -EINTR ) {
+      throw std::runtime_error( "ring_buffer__poll() failed" );
+    }
+    if ( err > 0 && after_poll_ ) {
+      after_poll_();
+    }
+    check_insert_failures();
+  }
+}
+
+void KernelQuacker::check_insert_failures()
+{
+  auto now = std::chrono::steady_clock::now();
+  if ( now < next_failure_check_ ) {
+    return;
+  }
+  next_failure_check_ = now + FAILURE_CHECK_INTERVAL;
+
+  uint32_t zero = 0;
+  if ( bpf_map_lookup_elem( insert_failures_fd_, &zero, per_cpu_insert_failures_.data() ) < 0 ) {
+    throw std::runtime_error( "Unable to read eBPF insert failures" );
+  }
+  uint64_t total = 0;
+  for ( uint64_t failures : per_cpu_insert_failures_ ) {
+    total += failures;
+  }
+  if ( total > insert_failures_ ) {
+    LOG_WARN( "eBPF program on ",
+              interface_,
+              " could not track a flow for ",
+              total - insert_failures_,
+              " packets (",
+              total,
+              " in total)" );
+    insert_failures_ = total;
+  }
+}
+
+int KernelQuacker::handle_event( void* ctx, void* data, size_t size )
+{
+  auto _this = static_cast<KernelQuacker*>( ctx );
+  if ( size < sizeof( quack_bpf_event ) ) {
+    return 0;
+  }
+  uint32_t src = static_cast<const quack_bpf_event*>( data )->src;
+
+  if ( bpf_map_lookup_elem( _this->sums_fd_, &src, _this->per_cpu_sums_.data() ) < 0 ) {
+    return 0;
+  }
+
+  // Power sums and counts add up across CPUs; the last id is whichever was seen most recently
+  std::fill( _this->sums_.begin(), _this->sums_.end(), 0 );
+  uint32_t count = 0;
+  const quack_bpf_sums* latest = &_this->per_cpu_sums_[0];
+  for ( const auto& cpu : _this->per_cpu_sums_ ) {
+    for ( size_t i = 0; i < _this->sums_.size(); i++ ) {
+      _this->sums_[i] += cpu.sums[i];
+    }
+    count += cpu.count;
+    if ( cpu.last_seen_ns > latest->last_seen_ns ) {
+      latest = &cpu;
+    }
+  }
+
+  _this->on_quack_( src, _this->sums_, count, latest->last_received_id );
+  return 0;
+}
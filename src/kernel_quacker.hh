@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ipv4_datagram.hh"
+#include "quack.hh"
+#include "quack_bpf.h"
+
+struct bpf_object;
+struct ring_buffer;
+
+// Loads quack.bpf.c onto an interface's tc ingress hook, which keeps the power sums of every flow in the kernel,
+// and reads them back whenever the program says a flow is due a quACK. Kept apart from the pcap code, since
+// libbpf and libpcap headers both define `struct bpf_insn`.
+class KernelQuacker
+{
+public:
+  // Called with a flow's source address, power sums and count over every id it ever sent, and its last id
+  using Handler = std::function<void( IPv4Address, std::span<const QuackInt>, uint32_t, uint32_t )>;
+
+private:
+  std::string interface_;
+  Handler on_quack_;
+  std::function<void()> after_poll_ {};
+
+  bpf_object* object_ {};
+  ring_buffer* events_ {};
+  int ifindex_ {};
+  int sums_fd_ { -1 };
+
+  // One copy of a flow's state per possible CPU, as read from the per-CPU map
+  std::vector<quack_bpf_sums> per_cpu_sums_ {};
+  std::vector<QuackInt> sums_ {};
+
+  // The program's failed inserts are read (one syscall) at most this often, and warned about when there are any
+  static constexpr std::chrono::seconds FAILURE_CHECK_INTERVAL { 1 };
+  int insert_failures_fd_ { -1 };
+  std::vector<uint64_t> per_cpu_insert_failures_ {};
+  uint64_t insert_failures_ {};
+  std::chrono::steady_clock::time_point next_failure_check_ {};
+  void check_insert_failures();
+
+  static int handle_event( void* ctx, void* data, size_t size );
+
+public:
+  KernelQuacker( const std::string& interface,
+                 const std::string& object_path,
+                 uint16_t dst_port,
+                 size_t quacking_packet_interval,
+                 size_t num_power_sums,
+                 Handler on_quack );
+  ~KernelQuacker();
+
+  KernelQuacker( const KernelQuacker& ) = delete;
+  KernelQuacker& operator=( const KernelQuacker& ) = delete;
+
+  // Called once the flows found due by each wakeup have all been handled, e.g. to send their quACKs together
+  void after_poll( std::function<void()> f ) { after_poll_ = std::move( f ); }
+
+  // Wait for flows to become due a quACK until the process exits
+  void run();
+};
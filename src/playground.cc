@@ -1,7 +1,9 @@
 #include <array>
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <random>
+#include <span>
 #include <thread>
 #include <vector>
 
@@ -13,9 +15,9 @@ void arithmetic()
 {
   // Zero packet id doesn't work as expected, which is fine
   // x^2 - 1x + 0
-  // std::vector<ModInt> pkt_ids = { 0, 1 };
+  // std::vector<QuackInt> pkt_ids = { 0, 1 };
 
-  std::vector<ModInt> pkt_ids = { 4294967291 - 2, 4294967291 - 1, 4294967291 + 1, 4294967291 + 2, 3, 4, 5 };
+  std::vector<QuackInt> pkt_ids = { 4294967291 - 2, 4294967291 - 1, 4294967291 + 1, 4294967291 + 2, 3, 4, 5 };
   PowerSums client_power_sums( 8 );
   PowerSums proxy_power_sums( 8 );
 
@@ -0,0 +1,159 @@
+// tc ingress program that folds the id of every matching UDP packet into per-flow power sums, so the proxy doesn't
+// have to see packets at all. It only wakes the proxy, through a ring buffer, when a flow is due a quACK.
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/pkt_cls.h>
+#include <linux/udp.h>
+
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include "quack_bpf.h"
+
+struct
+{
+  __uint( type, BPF_MAP_TYPE_ARRAY );
+  __uint( max_entries, 1 );
+  __type( key, __u32 );
+  __type( value, struct quack_bpf_config );
+} quack_config SEC( ".maps" );
+
+// Per-CPU, so packets on different queues never contend for the sums. Nothing deletes flows, so once the map is
+// full the least recently used one makes room for a new one and starts over from nothing if it comes back.
+struct
+{
+  __uint( type, BPF_MAP_TYPE_LRU_PERCPU_HASH );
+  __uint( max_entries, QUACK_BPF_MAX_FLOWS );
+  __type( key, __u32 );
+  __type( value, struct quack_bpf_sums );
+} quack_sums SEC( ".maps" );
+
+// Packets counted per flow across all CPUs, to tell when a quACK is due
+struct
+{
+  __uint( type, BPF_MAP_TYPE_LRU_HASH );
+  __uint( max_entries, QUACK_BPF_MAX_FLOWS );
+  __type( key, __u32 );
+  __type( value, __u64 );
+} quack_packets SEC( ".maps" );
+
+// Recently counted ids; the oldest are forgotten first
+struct
+{
+  __uint( type, BPF_MAP_TYPE_LRU_HASH );
+  __uint( max_entries, QUACK_BPF_MAX_FLOWS * QUACK_BPF_DUPLICATE_HORIZON );
+  __type( key, struct quack_bpf_id );
+  __type( value, __u8 );
+} quack_seen SEC( ".maps" );
+
+// Failed inserts into quack_sums or quack_packets, each a packet that went uncounted or never made its flow due a
+// quACK, for the proxy to warn about
+struct
+{
+  __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+  __uint( max_entries, 1 );
+  __type( key, __u32 );
+  __type( value, __u64 );
+} quack_insert_failures SEC( ".maps" );
+
+struct
+{
+  __uint( type, BPF_MAP_TYPE_RINGBUF );
+  __uint( max_entries, 1 << 16 );
+} quack_events SEC( ".maps" );
+
+// Look up `key` in `map`, inserting `empty` first if it isn't there yet. Counts a failure if it still isn't.
+static __always_inline void* lookup_or_insert( void* map, const void* key, const void* empty )
+{
+  void* value = bpf_map_lookup_elem( map, key );
+  if ( value ) {
+    return value;
+  }
+  bpf_map_update_elem( map, key, empty, BPF_NOEXIST );
+  value = bpf_map_lookup_elem( map, key );
+  if ( !value ) {
+    __u32 zero = 0;
+    __u64* failures = bpf_map_lookup_elem( &quack_insert_failures, &zero );
+    if ( failures ) {
+      ( *failures )++;
+    }
+  }
+  return value;
+}
+
+SEC( "tc" )
+int quack_ingress( struct __sk_buff* skb )
+{
+  __u32 zero = 0;
+  struct quack_bpf_config* config = bpf_map_lookup_elem( &quack_config, &zero );
+  if ( !config || config->interval == 0 ) {
+    return TC_ACT_OK;
+  }
+
+  void* data = (void*)(long)skb->data;
+  void* data_end = (void*)(long)skb->data_end;
+
+  struct ethhdr* eth = data;
+  if ( (void*)( eth + 1 ) > data_end || eth->h_proto != bpf_htons( ETH_P_IP ) ) {
+    return TC_ACT_OK;
+  }
+
+  // Later fragments don't start with a UDP header
+  struct iphdr* ip = (void*)( eth + 1 );
+  if ( (void*)( ip + 1 ) > data_end || ip->version != 4 || ip->ihl < 5 || ip->protocol != IPPROTO_UDP
+       || ( ip->frag_off & bpf_htons( 0x1fff ) ) ) {
+    return TC_ACT_OK;
+  }
+
+  // The IPv4 header length varies, so read the rest through the helper rather than bounds-checking each access
+  __u32 udp_offset = sizeof( struct ethhdr ) + ip->ihl * 4;
+  struct udphdr udp;
+  if ( bpf_skb_load_bytes( skb, udp_offset, &udp, sizeof( udp ) ) < 0 ) {
+    return TC_ACT_OK;
+  }
+  if ( config->dst_port && udp.dest != bpf_htons( config->dst_port ) ) {
+    return TC_ACT_OK;
+  }
+
+  // Taken as a host-order integer straight from the payload bytes, which is what str_to_uint() gives user space
+  __u32 id;
+  if ( bpf_skb_load_bytes( skb, udp_offset + sizeof( udp ) + QUACK_BPF_ID_OFFSET, &id, sizeof( id ) ) < 0 ) {
+    return TC_ACT_OK;
+  }
+
+  struct quack_bpf_id seen = { .src = bpf_ntohl( ip->saddr ), .id = id };
+  __u8 one = 1;
+  if ( bpf_map_update_elem( &quack_seen, &seen, &one, BPF_NOEXIST ) < 0 ) {
+    return TC_ACT_OK;
+  }
+
+  struct quack_bpf_sums empty_sums = {};
+  struct quack_bpf_sums* sums = lookup_or_insert( &quack_sums, &seen.src, &empty_sums );
+  if ( !sums ) {
+    return TC_ACT_OK;
+  }
+
+  // Same as PowerSums::add(), reducing after every step since BPF has no 128-bit multiply
+  __u64 x = seen.id >= QUACK_BPF_MODULUS ? seen.id - QUACK_BPF_MODULUS : seen.id;
+  __u64 power = x;
+  for ( __u32 i = 0; i < QUACK_BPF_MAX_THRESHOLD && i < config->threshold; i++ ) {
+    sums->sums[i] = ( sums->sums[i] + power ) % QUACK_BPF_MODULUS;
+    power = ( power * x ) % QUACK_BPF_MODULUS;
+  }
+  sums->count++;
+  sums->last_received_id = seen.id;
+  sums->last_seen_ns = bpf_ktime_get_ns();
+
+  __u64 no_packets = 0;
+  __u64* packets = lookup_or_insert( &quack_packets, &seen.src, &no_packets );
+  if ( packets && ( __sync_fetch_and_add( packets, 1 ) + 1 ) % config->interval == 0 ) {
+    struct quack_bpf_event event = { .src = seen.src };
+    bpf_ringbuf_output( &quack_events, &event, sizeof( event ), 0 );
+  }
+
+  return TC_ACT_OK;
+}
+
+char LICENSE[] SEC( "license" ) = "Dual BSD/GPL";
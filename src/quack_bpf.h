@@ -0,0 +1,47 @@
+// Layout shared by the quACK eBPF program (quack.bpf.c) and the proxy that loads it
+#pragma once
+
+#include <linux/types.h>
+
+// Must match QUACK_MODULUS and QUACK_ID_OFFSET, which the proxy checks at compile time
+#define QUACK_BPF_MODULUS 4294967291ULL
+#define QUACK_BPF_ID_OFFSET 8
+
+// Power sums kept per flow, including a checksum sum if one is sent
+#define QUACK_BPF_MAX_THRESHOLD 32
+
+#define QUACK_BPF_MAX_FLOWS 1024
+
+// Recent ids remembered per flow (on average) to count duplicates once, like PowerSums' duplicate filter
+#define QUACK_BPF_DUPLICATE_HORIZON 1024
+
+// Set by the proxy before the program sees any traffic
+struct quack_bpf_config
+{
+  __u32 threshold; // Number of power sums to keep
+  __u32 interval;  // Notify the proxy every `interval` packets in a flow
+  __u16 dst_port;  // Only count UDP packets to this port, or 0 for any
+  __u16 pad;
+};
+
+// Per-CPU state of a flow, keyed by IPv4 source address in host order. The proxy adds up every CPU's sums and
+// counts, and takes the last id from whichever CPU saw a packet most recently.
+struct quack_bpf_sums
+{
+  __u64 last_seen_ns;
+  __u32 last_received_id;
+  __u32 count;
+  __u32 sums[QUACK_BPF_MAX_THRESHOLD];
+};
+
+struct quack_bpf_id
+{
+  __u32 src;
+  __u32 id;
+};
+
+// Sent through the ring buffer when a flow is due a quACK
+struct quack_bpf_event
+{
+  __u32 src;
+};
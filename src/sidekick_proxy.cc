@@ -1,18 +1,77 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
+#include <poll.h>
+
 #include "cli11.hh"
+#include "histogram.hh"
+#include "log.hh"
+#include "runtime.hh"
 #include "sidekick_proxy.hh"
 
-PacketCapture::PacketCapture( const std::string& interface, const std::string& filter )
+#ifdef SIDEKICK_EBPF
+#include "kernel_quacker.hh"
+#endif
+
+std::optional<CapturedPacket> parse_captured_packet( std::string_view frame, uint64_t captured_at_ns )
+{
+  if ( frame.size() < ETH_HDR_LEN + IP_HDR_LEN ) {
+    return {};
+  }
+
+  auto ip = reinterpret_cast<const struct iphdr*>( frame.data() + ETH_HDR_LEN );
+  size_t ip_hdr_len = ip->ihl * 4;
+
+  // Later fragments don't start with a UDP header
+  if ( ip->version != 4 || ip->protocol != IPPROTO_UDP || ip_hdr_len < IP_HDR_LEN
+       || ( be16toh( ip->frag_off ) & IP_FRAG_OFFSET_MASK ) != 0
+       || frame.size() < ETH_HDR_LEN + ip_hdr_len + UDP_HDR_LEN ) {
+    return {};
+  }
+
+  auto udp = reinterpret_cast<const struct udphdr*>( frame.data() + ETH_HDR_LEN + ip_hdr_len );
+  auto packet_id = get_packet_id( frame.substr( ETH_HDR_LEN + ip_hdr_len + UDP_HDR_LEN ) );
+  if ( !packet_id.has_value() ) {
+    return {};
+  }
+
+  return CapturedPacket {
+    .src = be32toh( ip->saddr ),
+    .dst = be32toh( ip->daddr ),
+    .src_port = be16toh( udp->source ),
+    .dst_port = be16toh( udp->dest ),
+    .packet_id = packet_id.value(),
+    .captured_at_ns = captured_at_ns,
+  };
+}
+
+PacketCapture::PacketCapture( const std::string& interface,
+                              const std::string& filter,
+                              bool min_snaplen,
+                              std::optional<uint16_t> fanout_group )
 {
   interface_ = interface;
-  datagrams_ = std::make_shared<conqueue<IPv4Datagram>>();
 
   std::string errbuf;
   errbuf.resize( PCAP_ERRBUF_SIZE );
-  pcap_handle_ = pcap_open_live( interface.c_str(), BUFSIZ, PCAP_PROMISC, PCAP_TIMEOUT, errbuf.data() );
+  pcap_handle_ = pcap_create( interface.c_str(), errbuf.data() );
   if ( pcap_handle_ == NULL ) {
-    throw std::runtime_error( "pcap_open_live() failed: " + errbuf );
+    throw std::runtime_error( "pcap_create() failed: " + errbuf );
+  }
+
+  if ( pcap_set_snaplen( pcap_handle_, min_snaplen ? MIN_SNAPLEN : BUFSIZ ) != 0
+       || pcap_set_promisc( pcap_handle_, PCAP_PROMISC ) != 0
+       || pcap_set_timeout( pcap_handle_, PCAP_TIMEOUT ) != 0 ) {
+    throw std::runtime_error( "Unable to configure pcap handle" );
+  }
+
+  if ( pcap_activate( pcap_handle_ ) < 0 ) {
+    throw std::runtime_error( "pcap_activate() failed: " + std::string( pcap_geterr( pcap_handle_ ) ) );
+  }
+
+  if ( fanout_group.has_value() ) {
+    join_fanout_group( pcap_fileno( pcap_handle_ ), fanout_group.value() );
   }
 
   // Only capture incoming packets
@@ -34,107 +93,919 @@ PacketCapture::PacketCapture( const std::string& interface, const std::string& f
 
 void PacketCapture::run()
 {
-  std::cerr << "PacketSniffer started, sniffing on interface " << interface_ << std::endl;
-  if ( pcap_loop( pcap_handle_, 0, packet_handler, reinterpret_cast<u_char*>( this ) ) < 0 ) {
-    throw std::runtime_error( "pcap_loop() failed" );
+  LOG_INFO( "PacketSniffer started, sniffing on interface ", interface_ );
+
+  // To wake up for ticks even when no packets come, don't block in libpcap but in poll(), with a timeout
+  if ( tick_handler_ ) {
+    std::string errbuf;
+    errbuf.resize( PCAP_ERRBUF_SIZE );
+    if ( pcap_setnonblock( pcap_handle_, 1, errbuf.data() ) < 0 ) {
+      throw std::runtime_error( "pcap_setnonblock() failed: " + errbuf );
+    }
+  }
+
+  // Each dispatch runs the callback over everything libpcap got in one read (a whole block with TPACKET_V3), and
+  // the sender gets all of it at once
+  while ( true ) {
+    int count = pcap_dispatch( pcap_handle_, -1, packet_handler, reinterpret_cast<u_char*>( this ) );
+    if ( count < 0 ) {
+      throw std::runtime_error( "pcap_dispatch() failed: " + std::string( pcap_geterr( pcap_handle_ ) ) );
+    }
+    if ( count == 0 && tick_handler_ ) {
+      pollfd pfd { .fd = pcap_get_selectable_fd( pcap_handle_ ), .events = POLLIN, .revents = 0 };
+      if ( poll( &pfd, 1, tick_period_.count() ) < 0 && errno != EINTR ) {
+        throw std::runtime_error( "poll() on pcap handle failed" );
+      }
+    }
+    flush();
   }
 }
 
 void PacketCapture::packet_handler( u_char* user, const struct pcap_pkthdr* pkthdr, const u_char* packet )
 {
-  if ( pkthdr->caplen < ETH_HDR_LEN + IP_HDR_LEN ) {
+  // Read straight out of libpcap's buffer; only the fields we need are copied into the queue
+  uint64_t captured_at_ns = static_cast<uint64_t>( pkthdr->ts.tv_sec ) * 1'000'000'000 + pkthdr->ts.tv_usec * 1'000;
+  auto captured
+    = parse_captured_packet( { reinterpret_cast<const char*>( packet ), pkthdr->caplen }, captured_at_ns );
+  if ( !captured.has_value() ) {
     return;
   }
 
-  IPv4Datagram datagram;
-  std::string data( reinterpret_cast<const char*>( packet ) + ETH_HDR_LEN, pkthdr->caplen - ETH_HDR_LEN );
-  if ( !parse( datagram, { data } ) ) {
-    std::cerr << "Unable to parse IPv4Datagram" << std::endl;
+  PacketCapture* _this = reinterpret_cast<PacketCapture*>( user );
+  _this->deliver( captured.value() );
+}
+
+RingCapture::RingCapture( const std::string& interface,
+                          const std::string& filter,
+                          bool min_snaplen,
+                          std::optional<uint16_t> fanout_group )
+  : interface_( interface )
+{
+  // libpcap only compiles the filter; the program's return value is how much of each packet the ring keeps
+  pcap_t* dead = pcap_open_dead( DLT_EN10MB, min_snaplen ? MIN_SNAPLEN : BUFSIZ );
+  if ( dead == NULL ) {
+    throw std::runtime_error( "pcap_open_dead() failed" );
+  }
+
+  struct bpf_program bpf;
+  if ( pcap_compile( dead, &bpf, filter.data(), PCAP_OPTIMIZE, PCAP_NETMASK_UNKNOWN ) < 0 ) {
+    pcap_close( dead );
+    throw std::runtime_error( "pcap_compile() failed" );
+  }
+
+  // Classic BPF instructions are laid out the same for libpcap and the kernel
+  static_assert( sizeof( struct bpf_insn ) == sizeof( struct sock_filter ) );
+  sock_fprog program { .len = static_cast<unsigned short>( bpf.bf_len ),
+                       .filter = reinterpret_cast<struct sock_filter*>( bpf.bf_insns ) };
+  ring_ = std::make_unique<PacketRing>( interface, program );
+  if ( fanout_group.has_value() ) {
+    ring_->join_fanout_group( fanout_group.value() );
+  }
+
+  pcap_freecode( &bpf );
+  pcap_close( dead );
+}
+
+void RingCapture::run()
+{
+  LOG_INFO( "RingCapture started, sniffing on interface ", interface_ );
+  if ( tick_handler_ ) {
+    ring_->set_poll_timeout( tick_period_ );
+  }
+  ring_->run(
+    [&]( std::string_view frame, uint64_t captured_at_ns ) {
+      auto captured = parse_captured_packet( frame, captured_at_ns );
+      if ( captured.has_value() ) {
+        deliver( captured.value() );
+      }
+    },
+    // One lock and wakeup per block rather than per packet
+    [&] {
+      flush();
+      check_drops();
+    } );
+}
+
+void RingCapture::check_drops()
+{
+  auto now = std::chrono::steady_clock::now();
+  if ( now < next_drop_check_ ) {
     return;
   }
+  next_drop_check_ = now + DROP_CHECK_INTERVAL;
 
-  PacketCapture* _this = reinterpret_cast<PacketCapture*>( user );
-  _this->datagrams_->push( datagram );
+  uint32_t drops = ring_->drops();
+  if ( drops > 0 ) {
+    drops_ += drops;
+    LOG_WARN( "Packet ring on ", interface_, " was full and dropped ", drops, " packets (", drops_, " in total)" );
+  }
+}
+
+ReplayCapture::ReplayCapture( const std::string& path, const std::string& filter, double rate )
+  : path_( path ), rate_( rate )
+{
+  std::string errbuf;
+  errbuf.resize( PCAP_ERRBUF_SIZE );
+  pcap_handle_ = pcap_open_offline( path.c_str(), errbuf.data() );
+  if ( pcap_handle_ == NULL ) {
+    throw std::runtime_error( "pcap_open_offline() failed: " + errbuf );
+  }
+
+  if ( pcap_datalink( pcap_handle_ ) != DLT_EN10MB ) {
+    throw std::runtime_error( "Only Ethernet captures can be replayed" );
+  }
+
+  struct bpf_program bpf;
+  if ( pcap_compile( pcap_handle_, &bpf, filter.data(), PCAP_OPTIMIZE, PCAP_NETMASK_UNKNOWN ) < 0 ) {
+    throw std::runtime_error( "pcap_compile() failed" );
+  }
+  if ( pcap_setfilter( pcap_handle_, &bpf ) == -1 ) {
+    throw std::runtime_error( "pcap_setfilter() failed" );
+  }
+  pcap_freecode( &bpf );
+}
+
+void ReplayCapture::run()
+{
+  LOG_INFO( "ReplayCapture started, replaying ", path_ );
+
+  struct pcap_pkthdr* pkthdr;
+  const u_char* packet;
+  std::optional<std::chrono::microseconds> first_timestamp;
+  auto started_at = std::chrono::steady_clock::now();
+
+  // Counted here rather than from `batch_`, which stays empty when packets are handled through deliver_to()
+  size_t unflushed = 0;
+
+  int result;
+  while ( ( result = pcap_next_ex( pcap_handle_, &pkthdr, &packet ) ) == 1 ) {
+    frames_read_++;
+
+    // Hold each packet back until its offset into the recording, scaled by the rate, has passed
+    if ( rate_ > 0 ) {
+      auto timestamp = std::chrono::seconds( pkthdr->ts.tv_sec ) + std::chrono::microseconds( pkthdr->ts.tv_usec );
+      if ( !first_timestamp.has_value() ) {
+        first_timestamp = timestamp;
+      }
+      std::this_thread::sleep_until( started_at
+                                     + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                       ( timestamp - first_timestamp.value() ) / rate_ ) );
+    }
+
+    // The recorded timestamps are long past, so latency is measured from when the packet is read
+    auto captured
+      = parse_captured_packet( { reinterpret_cast<const char*>( packet ), pkthdr->caplen }, realtime_ns() );
+    if ( captured.has_value() ) {
+      deliver( captured.value() );
+      unflushed++;
+    }
+    if ( unflushed >= MAX_BATCH || rate_ > 0 ) {
+      flush();
+      unflushed = 0;
+    }
+  }
+  flush();
+
+  if ( result == PCAP_ERROR ) {
+    throw std::runtime_error( "pcap_next_ex() failed: " + std::string( pcap_geterr( pcap_handle_ ) ) );
+  }
 }
 
 void SidekickSender::run()
 {
-  std::cerr << "SidekickSender started" << std::endl;
+  LOG_INFO( "SidekickSender started" );
 
-  // Pull datagrams off the sniffer's queue
+  // Pull everything the sniffer has queued at once, waking up every tick if quACKs are also sent on time or some
+  // are waiting for budget
   while ( 1 ) {
-    IPv4Datagram datagram = datagrams_->pop();
-    handle_datagram( datagram );
+    if ( has_emission_timers() || !deferred_.empty() ) {
+      packets_->pop_all_for( batch_, TIMER_TICK );
+    } else {
+      packets_->pop_all( batch_ );
+    }
+    for ( const auto& packet : batch_ ) {
+      handle_packet( packet );
+    }
+    after_batch();
   }
 }
 
-void SidekickSender::handle_datagram( IPv4Datagram& datagram )
+void SidekickSender::after_batch()
 {
-  // We only support UDP protocols for this replication study
-  if ( datagram.header.proto != IPPROTO_UDP ) {
-    std::cerr << "Received datagram: " << datagram.header.to_string() << std::endl;
-    return;
+  auto now = std::chrono::steady_clock::now();
+  if ( !deferred_.empty() ) {
+    send_deferred( now );
+  }
+  if ( has_emission_timers() ) {
+    tick( now );
+  }
+  if ( is_adaptive() ) {
+    poll_feedback();
   }
+  flush_quacks();
+}
 
-  // Retrieve packet id from specific offset in UDP payload as determined by the sidekick protocol
-  std::string ip_payload = std::accumulate( datagram.payload.begin(), datagram.payload.end(), std::string {} );
-  auto packet_id = get_packet_id( std::string_view( ip_payload ).substr( UDP_HDR_LEN ) );
-  if ( packet_id.has_value() ) {
-    update_quack( datagram.header.src, packet_id.value() );
+void SidekickSender::flush_quacks()
+{
+  if ( size_t sent = quacking_socket_.flush() ) {
+    quack_batch_sizes_.record( sent );
   }
 }
 
-void SidekickSender::update_quack( IPv4Address src_address, uint32_t packet_id )
+void SidekickSender::set_adaptive_bounds( size_t min_threshold,
+                                          size_t max_threshold,
+                                          size_t min_interval,
+                                          size_t max_interval )
 {
-  if ( quacks_.find( src_address ) == quacks_.end() ) {
-    quacks_.insert( { src_address, { 0, 0, missing_packet_threshold_ } } );
+  if ( min_threshold == 0 || min_threshold > max_threshold || min_interval == 0 || min_interval > max_interval ) {
+    throw std::runtime_error( "Adaptive bounds must be positive, with min <= max" );
+  }
+  if ( Quack::max_size( max_threshold + ( quack_checksum_ ? 1 : 0 ) ) > MAX_QUACK_SIZE ) {
+    throw std::runtime_error( "Highest threshold is too large to fit a quACK in one datagram" );
   }
 
-  auto& quack = quacks_[src_address];
-  quack.num_received++;
-  quack.last_received_id = packet_id;
-  quack.power_sums.add( packet_id );
+  min_threshold_ = min_threshold;
+  max_threshold_ = max_threshold;
+  min_interval_ = min_interval;
+  max_interval_ = max_interval;
+  missing_packet_threshold_ = std::clamp( missing_packet_threshold_, min_threshold, max_threshold );
+  quacking_packet_interval_ = std::clamp( quacking_packet_interval_, min_interval, max_interval );
+}
+
+void SidekickSender::set_quack_budget( double rate, double destination_rate )
+{
+  if ( rate < 0 || destination_rate < 0 ) {
+    throw std::runtime_error( "QuACK budgets can't be negative" );
+  }
+
+  // A bucket smaller than the largest quACK would hold it back forever
+  auto now = std::chrono::steady_clock::now();
+  double largest = Quack::max_size( num_power_sums() ) + IP_HDR_LEN + UDP_HDR_LEN;
+  auto bucket = [&]( double bytes_per_second ) {
+    double burst = bytes_per_second * std::chrono::duration<double>( BUDGET_BURST ).count();
+    return TokenBucket( bytes_per_second, std::max( burst, largest ), now );
+  };
+
+  quack_budget_.reset();
+  destination_budget_.reset();
+  destination_budgets_.reset();
+  if ( rate > 0 ) {
+    quack_budget_.emplace( bucket( rate ) );
+  }
+  if ( destination_rate > 0 ) {
+    destination_budget_.emplace( bucket( destination_rate ) );
+    destination_budgets_.emplace( flows_.capacity() );
+  }
+}
+
+bool SidekickSender::within_budget( IPv4Address destination,
+                                    size_t bytes,
+                                    std::chrono::steady_clock::time_point now )
+{
+  TokenBucket* per_destination = nullptr;
+  if ( destination_budgets_ ) {
+    // A bucket left alone long enough to fill up is no different from a new one
+    destination_budgets_->expire( now - destination_budget_->refill_time() );
+    per_destination
+      = &destination_budgets_->find_or_insert( destination, now, [&] { return *destination_budget_; } );
+  }
+
+  if ( ( quack_budget_ && !quack_budget_->has( bytes, now ) )
+       || ( per_destination && !per_destination->has( bytes, now ) ) ) {
+    return false;
+  }
+  if ( quack_budget_ ) {
+    quack_budget_->take( bytes );
+  }
+  if ( per_destination ) {
+    per_destination->take( bytes );
+  }
+  return true;
+}
+
+void SidekickSender::send_deferred( std::chrono::steady_clock::time_point now )
+{
+  // Each quACK held gets one try, and goes to the back again if it still doesn't fit
+  for ( size_t n = deferred_.size(); n > 0; n-- ) {
+    // Not even the smallest quACK would fit
+    if ( quack_budget_ && !quack_budget_->has( Quack::max_size( 0 ) + IP_HDR_LEN + UDP_HDR_LEN, now ) ) {
+      break;
+    }
+
+    FlowKey key = deferred_.front();
+    deferred_.pop_front();
+
+    // The flow may have been dropped since
+    auto* flow = flows_.find( key );
+    if ( !flow || !flow->deferred ) {
+      continue;
+    }
+
+    // Catch up on the ids that came in while it waited
+    if ( !flow->pending_ids.empty() ) {
+      fold_pending_ids( *flow, now );
+    }
+    if ( transmit_quack( key, *flow, now ) ) {
+      flow->deferred = false;
+    } else {
+      deferred_.push_back( key );
+    }
+  }
+}
+
+void SidekickSender::set_threshold( Quack& quack, size_t threshold ) const
+{
+  quack.threshold = threshold;
+  quack.num_sums = threshold + ( quack_checksum_ ? 1 : 0 );
+}
+
+void SidekickSender::poll_feedback()
+{
+  while ( auto from = quacking_socket_.try_recvfrom( feedback_ ) ) {
+    QuackFeedback feedback;
+    if ( !parse( feedback, { feedback_ } ) || from->raw()->sa_family != AF_INET ) {
+      LOG_WARN( "Ignoring malformed quACK feedback from ", *from );
+      continue;
+    }
+
+    // The kernel only tells flows apart by source address
+    FlowKey key { from->ipv4_numeric(), feedback.dst, feedback.src_port, feedback.dst_port };
+    auto* flow = flows_.find( key );
+    if ( !flow ) {
+      flow = flows_.find( FlowKey { .src = key.src } );
+    }
+    if ( flow ) {
+      adapt( *flow, feedback );
+    }
+  }
+}
+
+void SidekickSender::adapt( QuackFlow& flow, const QuackFeedback& feedback )
+{
+  double loss = feedback.packets ? static_cast<double>( feedback.missing ) / feedback.packets : 0;
+  flow.loss_rate += LOSS_SMOOTHING * ( loss - flow.loss_rate );
+  flow.burst = std::max<double>( feedback.max_missing, BURST_DECAY * flow.burst );
+
+  // Enough sums for the worst quACK lately, and for twice the losses expected between quACKs, with one to spare.
+  // More are added at once, but dropped one at a time.
+  size_t threshold = flow.quack.threshold;
+  size_t needed = std::ceil( std::max( flow.burst, 2 * flow.loss_rate * flow.interval ) ) + 1;
+  if ( feedback.overflows > 0 ) {
+    threshold = std::max( needed, 2 * threshold );
+  } else if ( needed > threshold ) {
+    threshold = needed;
+  } else if ( needed < threshold ) {
+    threshold--;
+  }
+
+  // Clean flows are quACKed less and less often, while a quACK would still expect less than one loss. Lossy ones
+  // are quACKed more often, so losses are found soon and fewer of them have to be solved for at once.
+  size_t interval = flow.interval;
+  if ( feedback.missing > 0 || feedback.overflows > 0 ) {
+    interval /= 2;
+  } else if ( 2 * interval * flow.loss_rate < 1 ) {
+    interval *= 2;
+  }
+
+  // Never down to no sums at all, which no receiver can decode against
+  threshold = std::clamp( threshold, std::max<size_t>( min_threshold_, 1 ), max_threshold_ );
+  interval = std::clamp( interval, min_interval_, max_interval_ );
+  if ( threshold != flow.quack.threshold || interval != flow.interval ) {
+    LOG_DEBUG(
+      "Adapting flow with loss rate ", flow.loss_rate, ": threshold ", threshold, ", interval ", interval );
+  }
+  set_threshold( flow.quack, threshold );
+  flow.interval = interval;
+}
+
+void SidekickSender::handle_packet( const CapturedPacket& packet )
+{
+  packets_handled_++;
+  FlowKey key { packet.src, packet.dst, packet.src_port, packet.dst_port };
+  update_quack( key, packet.packet_id, packet.captured_at_ns );
+
+  if ( report_interval_.count() > 0 && std::chrono::steady_clock::now() >= next_report_at_ ) {
+    report();
+    next_report_at_ += report_interval_;
+  }
+}
+
+void SidekickSender::report()
+{
+  auto print = []( const Histogram& latency ) {
+    auto us = []( uint64_t ns ) { return std::to_string( ns / 1000 ); };
+    return us( latency.percentile( 50 ) ) + "/" + us( latency.percentile( 99 ) ) + "/" + us( latency.max() )
+           + " us";
+  };
+
+  if ( process_latency_.count() > 0 ) {
+    LOG_INFO( "Latency (p50/p99/max), ",
+              process_latency_.count(),
+              " packets: capture->process ",
+              print( process_latency_ ),
+              ", capture->quACK ",
+              print( quack_latency_ ) );
+    process_latency_.clear();
+    quack_latency_.clear();
+  }
+
+  const auto& counters = flows_.counters();
+  LOG_INFO( "Flow table: ",
+            flows_.size(),
+            "/",
+            flows_.capacity(),
+            " flows, ",
+            static_cast<double>( counters.probes ) / std::max<uint64_t>( counters.lookups, 1 ),
+            " probes per lookup, ",
+            counters.inserts,
+            " inserted, ",
+            counters.evictions,
+            " evicted, ",
+            counters.expirations,
+            " expired" );
+
+  if ( quack_budget_ || destination_budgets_ ) {
+    LOG_INFO( "QuACK budget: ",
+              quacks_deferred_,
+              " deferred, ",
+              quacks_coalesced_,
+              " coalesced, ",
+              deferred_.size(),
+              " waiting" );
+  }
+
+  if ( quack_batch_sizes_.count() > 0 ) {
+    const auto& sizes = quack_batch_sizes_;
+    LOG_INFO( "QuACK batches: ",
+              sizes.count(),
+              " sendmmsg() calls, ",
+              sizes.mean(),
+              " quACKs per call (p50/p99/max ",
+              sizes.percentile( 50 ),
+              "/",
+              sizes.percentile( 99 ),
+              "/",
+              sizes.max(),
+              ")" );
+    quack_batch_sizes_.clear();
+  }
+}
+
+QuackFlow& SidekickSender::flow( const FlowKey& key, std::chrono::steady_clock::time_point now )
+{
+  // Cheap unless something is due to go: only the least recently used flow is looked at
+  flows_.expire( now - flow_idle_timeout_ );
+
+  return flows_.find_or_insert( key, now, [&] {
+    QuackFlow flow { .quack { .power_sums { num_power_sums() } }, .epoch_started_at = now };
+    set_threshold( flow.quack, missing_packet_threshold_ );
+    flow.destination = Address::from_ipv4_numeric( key.src, QUACK_LISTEN_PORT );
+    flow.last_emitted_at = now;
+    flow.interval = quacking_packet_interval_;
+    return flow;
+  } );
+}
+
+void SidekickSender::update_quack( const FlowKey& key, uint32_t packet_id, uint64_t captured_at_ns )
+{
+  auto now = std::chrono::steady_clock::now();
+  auto& flow = this->flow( key, now );
+  flow.pending_ids.push_back( packet_id );
+  flow.last_packet_at = now;
+  if ( captured_at_ns != 0 ) {
+    uint64_t now_ns = realtime_ns();
+    process_latency_.record( now_ns - std::min( captured_at_ns, now_ns ) );
+    flow.pending_captured_at_ns.push_back( captured_at_ns );
+  }
 
   // Send quack to sidekick receiver with the current state
-  if ( quack.num_received % quacking_packet_interval_ == 0 ) {
-    Address dest( inet_ntoa( { htobe32( src_address ) } ), QUACK_LISTEN_PORT );
+  if ( flow.pending_ids.size() >= flow.interval ) {
+    emit_quack( key, flow, now );
+  } else if ( has_emission_timers() && !flow.timer_armed ) {
+    // The deadline may move later with more packets; the timer catches up with it when it fires
+    timers_.schedule( key, emission_deadline( flow ) );
+    flow.timer_armed = true;
+  }
+}
 
-    std::cerr << "Sending quack to: " << dest.ip() << ":" << dest.port() << "\n"
-              << "num_received: " << quack.num_received << "\n"
-              << "last_received_id: " << quack.last_received_id << "\n"
-              << "power_sums: " << quack.power_sums << "\n"
-              << std::endl;
+void SidekickSender::emit_quack( const FlowKey& key, QuackFlow& flow, std::chrono::steady_clock::time_point now )
+{
+  fold_pending_ids( flow, now );
+  send_quack( key, flow, now );
+}
+
+void SidekickSender::fold_pending_ids( QuackFlow& flow, std::chrono::steady_clock::time_point now )
+{
+  auto& quack = flow.quack;
+  quack.power_sums.add_batch( flow.pending_ids );
+  quack.num_received = quack.power_sums.count();
+  quack.last_received_id = flow.pending_ids.back();
+  quack.add_received_ids( flow.pending_ids, num_power_sums() );
+  quack.choose_encoding();
+  flow.pending_ids.clear();
+  flow.last_emitted_at = now;
+}
+
+std::chrono::steady_clock::time_point SidekickSender::emission_deadline( const QuackFlow& flow ) const
+{
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if ( emit_interval_.count() > 0 ) {
+    deadline = std::min( deadline, flow.last_emitted_at + emit_interval_ );
+  }
+  if ( emit_after_silence_.count() > 0 ) {
+    deadline = std::min( deadline, flow.last_packet_at + emit_after_silence_ );
+  }
+  return deadline;
+}
+
+void SidekickSender::tick( std::chrono::steady_clock::time_point now )
+{
+  timers_.advance( now, [&]( const FlowKey& key ) {
+    // The flow may have been dropped since
+    auto* found = flows_.find( key );
+    if ( !found ) {
+      return;
+    }
+    auto& flow = *found;
+    flow.timer_armed = false;
+    if ( flow.pending_ids.empty() ) {
+      return;
+    }
+
+    auto deadline = emission_deadline( flow );
+    if ( deadline <= now ) {
+      emit_quack( key, flow, now );
+    } else {
+      timers_.schedule( key, deadline );
+      flow.timer_armed = true;
+    }
+  } );
+}
+
+void SidekickSender::update_quack_sums( IPv4Address src_address,
+                                        std::span<const QuackInt> cumulative_sums,
+                                        uint32_t cumulative_count,
+                                        uint32_t last_received_id )
+{
+  // The kernel only tells flows apart by source address
+  FlowKey key { .src = src_address };
+  auto now = std::chrono::steady_clock::now();
+  auto& flow = this->flow( key, now );
+  auto& quack = flow.quack;
+
+  if ( cumulative_sums.size() != num_power_sums() ) {
+    throw std::runtime_error( "SidekickSender::update_quack_sums() called with the wrong number of power sums" );
+  }
+  if ( flow.kernel_epoch_sums.empty() ) {
+    flow.kernel_epoch_sums.resize( cumulative_sums.size() );
+  }
+
+  // Fewer ids than last time: the kernel evicted the flow to make room for others, and has counted it from
+  // nothing since. Start a new epoch on its sums as they are. Ids counted before the eviction but never quACKed
+  // are lost with the old sums, and the receiver sees them as missing.
+  if ( cumulative_count < flow.kernel_epoch_count + quack.num_received ) {
+    LOG_DEBUG( "Kernel started flow from ", LogIPv4 { src_address }, " over, starting a new quack epoch" );
+    std::fill( flow.kernel_epoch_sums.begin(), flow.kernel_epoch_sums.end(), 0 );
+    flow.kernel_epoch_count = 0;
+    quack.next_epoch();
+    flow.epoch_started_at = now;
+  }
+
+  // Ids aren't seen one by one, so there is never a list to send
+  std::vector<QuackInt> sums( cumulative_sums.size() );
+  for ( size_t i = 0; i < sums.size(); i++ ) {
+    sums[i] = cumulative_sums[i] - flow.kernel_epoch_sums[i];
+  }
+  quack.power_sums = { sums };
+  quack.num_received = cumulative_count - flow.kernel_epoch_count;
+  quack.last_received_id = last_received_id;
+  quack.encoding = QuackEncoding::PowerSums;
+
+  send_quack( key, flow, now );
+}
+
+void SidekickSender::send_quack( const FlowKey& key, QuackFlow& flow, std::chrono::steady_clock::time_point now )
+{
+  // The quACK already held goes out with whatever the flow has by then, so this one needn't
+  if ( flow.deferred ) {
+    quacks_coalesced_++;
+    return;
+  }
 
-    auto serialized_quack = serialize( quack );
-    std::string payload = std::accumulate( serialized_quack.begin(), serialized_quack.end(), std::string {} );
-    quacking_socket_.sendto( payload, dest );
+  if ( !transmit_quack( key, flow, now ) ) {
+    flow.deferred = true;
+    deferred_.push_back( key );
+    quacks_deferred_++;
   }
 }
 
+bool SidekickSender::transmit_quack( const FlowKey& key,
+                                     QuackFlow& flow,
+                                     std::chrono::steady_clock::time_point now )
+{
+  auto& quack = flow.quack;
+
+  // Encoded on the stack: the id list is only chosen when it is smaller than the power sums, which fit
+  FixedSerializer<MAX_QUACK_SIZE> serializer;
+  quack.serialize( serializer );
+  if ( !within_budget( key.src, serializer.output().size() + IP_HDR_LEN + UDP_HDR_LEN, now ) ) {
+    return false;
+  }
+
+  LOG_DEBUG( "Sending quack to ",
+             LogIPv4 { key.src },
+             ":",
+             QUACK_LISTEN_PORT,
+             " epoch=",
+             quack.epoch,
+             " encoding=",
+             quack.encoding == QuackEncoding::IdList ? "id list" : "power sums",
+             " num_received=",
+             quack.num_received,
+             " last_received_id=",
+             quack.last_received_id,
+             " power_sums=",
+             quack.power_sums );
+
+  if ( !dry_run_ ) {
+    quacking_socket_.queue_sendto( serializer.output(), *flow.destination );
+  }
+  quack.mark_sent();
+  quacks_sent_++;
+
+  if ( !flow.pending_captured_at_ns.empty() ) {
+    uint64_t sent_at_ns = realtime_ns();
+    for ( auto captured_at_ns : flow.pending_captured_at_ns ) {
+      quack_latency_.record( sent_at_ns - std::min( captured_at_ns, sent_at_ns ) );
+    }
+    flow.pending_captured_at_ns.clear();
+  }
+
+  // The quACK just sent is the final state of this epoch
+  if ( quack.num_received >= epoch_packets_ || now - flow.epoch_started_at >= epoch_duration_ ) {
+    // Kernel sums only reset if the flow is evicted, so the next epoch is measured from where they stood for this
+    // quACK
+    for ( size_t i = 0; i < flow.kernel_epoch_sums.size(); i++ ) {
+      flow.kernel_epoch_sums[i] += quack.power_sums[i];
+    }
+    flow.kernel_epoch_count += quack.num_received;
+
+    quack.next_epoch();
+    flow.epoch_started_at = now;
+  }
+  return true;
+}
+
 int main( int argc, char* argv[] )
 {
   CLI::App app;
 
   std::string interface = "enp0s1";
-  std::string pcap_filter = PacketCapture::DEFAULT_FILTER;
+  std::string pcap_filter = Capture::DEFAULT_FILTER;
   size_t quacking_interval = 2;
   size_t missing_packet_threshold = 8;
+  bool quack_checksum = false;
+  bool min_snaplen = false;
+  std::string backend = "pcap";
+  std::vector<std::string> backends = { "pcap", "ring" };
+#ifdef SIDEKICK_EBPF
+  backends.push_back( "ebpf" );
+#endif
+  uint32_t epoch_packets = 3000;
+  uint64_t epoch_seconds = 60;
+  size_t workers = 1;
+  uint64_t report_seconds = 10;
+  uint64_t quack_ms = 0;
+  size_t max_flows = 16384;
+  uint64_t flow_idle_seconds = 300;
+  uint64_t silence_ms = 0;
+  size_t min_threshold = 0;
+  size_t max_threshold = 0;
+  size_t min_quack = 0;
+  size_t max_quack = 0;
+  double quack_kbps = 0;
+  double receiver_quack_kbps = 0;
+  std::string replay_file;
+  double replay_rate = 0;
 
   app.add_option( "-i,--interface", interface, "Interface to sniff packets on" )->capture_default_str();
   app.add_option( "-f,--filter", pcap_filter, "Packet sniffing filter" )->capture_default_str();
+  app.add_option( "-b,--backend", backend, "Capture with libpcap, or from a TPACKET_V3 ring" )
+    ->check( CLI::IsMember( backends ) )
+    ->capture_default_str();
+  app.add_flag( "--min-snaplen", min_snaplen, "Only capture packet headers and ids instead of whole packets" );
   app.add_option( "-q,--quack", quacking_interval, "Send quACKs every q packets" )->capture_default_str();
   app.add_option( "-t,--threshold", missing_packet_threshold, "Missing packet threshold" )->capture_default_str();
+  app.add_flag( "--checksum", quack_checksum, "Send an extra power sum in quACKs to validate decodes" );
+  app.add_option( "--min-threshold", min_threshold, "Lowest threshold a flow adapts to with feedback, 0 for -t" )
+    ->capture_default_str();
+  app.add_option( "--max-threshold", max_threshold, "Highest threshold a flow adapts to with feedback, 0 for -t" )
+    ->capture_default_str();
+  app.add_option( "--min-quack", min_quack, "Fewest packets per quACK a flow adapts to, 0 for -q" )
+    ->capture_default_str();
+  app.add_option( "--max-quack", max_quack, "Most packets per quACK a flow adapts to, 0 for -q" )
+    ->capture_default_str();
+  app.add_option( "--quack-kbps", quack_kbps, "Cap quACKs at this many kbit/s in all, 0 for no cap" )
+    ->check( CLI::NonNegativeNumber )
+    ->capture_default_str();
+  app.add_option( "--receiver-quack-kbps",
+                  receiver_quack_kbps,
+                  "Cap quACKs to any one receiver at this many kbit/s from each worker, 0 for no cap" )
+    ->check( CLI::NonNegativeNumber )
+    ->capture_default_str();
+  app.add_option( "--quack-ms", quack_ms, "Also send quACKs with new ids this often, 0 for only every q packets" )
+    ->capture_default_str();
+  app.add_option( "--silence-ms", silence_ms, "Also quACK flows with new ids once quiet this long, 0 for never" )
+    ->capture_default_str();
+  app.add_option( "--max-flows", max_flows, "Most flows to keep quACK state for, dropping the least recent" )
+    ->check( CLI::Range( size_t { 1 }, size_t { 1 } << 24 ) )
+    ->capture_default_str();
+  app.add_option( "--flow-idle-seconds", flow_idle_seconds, "Drop a flow's quACK state once idle this long" )
+    ->capture_default_str();
+  app.add_option( "--epoch-packets", epoch_packets, "Reset a flow's quACK state after this many packets" )
+    ->capture_default_str();
+  app.add_option( "--epoch-seconds", epoch_seconds, "Reset a flow's quACK state after this many seconds" )
+    ->capture_default_str();
+
+#ifdef SIDEKICK_EBPF
+  // The kernel does its own matching in this mode, on a destination port rather than a pcap filter
+  std::string ebpf_object = QUACK_BPF_OBJECT;
+  uint16_t ebpf_port = 0;
+  app.add_option( "--ebpf-object", ebpf_object, "Compiled quack.bpf.c for the ebpf backend" )->capture_default_str();
+  app.add_option( "--ebpf-port", ebpf_port, "Only count UDP packets to this port with the ebpf backend, 0 for any" )
+    ->capture_default_str();
+#endif
+
+  app.add_option( "-w,--workers", workers, "Capture and quACK on this many threads, splitting flows between them" )
+    ->check( CLI::Range( 1, 256 ) )
+    ->capture_default_str();
+
+  Runtime runtime;
+  runtime.add_options( app, "capture, sender, or worker0, worker1, ... with --workers" );
+  add_log_options( app );
+
+  app.add_option( "--report-seconds", report_seconds, "Print capture latency this often, 0 for never" )
+    ->capture_default_str();
+  app.add_option( "--replay", replay_file, "Replay a pcap file through the proxy and report its throughput" );
+  app.add_option( "--rate", replay_rate, "Replay at this multiple of recorded speed, 0 for as fast as possible" )
+    ->check( CLI::NonNegativeNumber )
+    ->capture_default_str();
 
   CLI11_PARSE( app, argc, argv );
+  runtime.start();
+
+  // Adaptive bounds left at zero are pinned to -t and -q
+  auto set_adaptive_bounds = [&]( SidekickSender& sender ) {
+    auto or_default = []( size_t value, size_t fallback ) { return value ? value : fallback; };
+    sender.set_adaptive_bounds( or_default( min_threshold, missing_packet_threshold ),
+                                or_default( max_threshold, missing_packet_threshold ),
+                                or_default( min_quack, quacking_interval ),
+                                or_default( max_quack, quacking_interval ) );
+  };
+
+  // Workers each see only their own flows, so they split the overall cap evenly
+  auto set_quack_budget = [&]( SidekickSender& sender, size_t senders ) {
+    auto bytes_per_second = []( double kbps ) { return kbps * 1000 / 8; };
+    sender.set_quack_budget( bytes_per_second( quack_kbps ) / senders, bytes_per_second( receiver_quack_kbps ) );
+  };
+
+#ifdef SIDEKICK_EBPF
+  if ( backend == "ebpf" ) {
+    if ( workers != 1 ) {
+      LOG_WARN( "The ebpf backend counts packets on every core already, ignoring --workers" );
+    }
+    SidekickSender sidekick( quacking_interval,
+                             missing_packet_threshold,
+                             quack_checksum,
+                             epoch_packets,
+                             std::chrono::seconds( epoch_seconds ),
+                             std::make_shared<batch_queue<CapturedPacket>>() );
+    set_adaptive_bounds( sidekick );
+    set_quack_budget( sidekick, 1 );
+    KernelQuacker quacker( interface,
+                           ebpf_object,
+                           ebpf_port,
+                           quacking_interval,
+                           sidekick.num_power_sums(),
+                           [&]( IPv4Address src, std::span<const QuackInt> sums, uint32_t count, uint32_t last_id ) {
+                             sidekick.update_quack_sums( src, sums, count, last_id );
+                           } );
+    // The kernel decides when quACKs are due, so only the threshold adapts
+    quacker.after_poll( [&] { sidekick.after_batch(); } );
+    runtime.enter_thread( "sender" );
+    quacker.run();
+    return EXIT_SUCCESS;
+  }
+#endif
+
+  auto make_capture = [&]( std::optional<uint16_t> fanout_group ) -> std::unique_ptr<Capture> {
+    std::unique_ptr<Capture> capture;
+    if ( backend == "ring" ) {
+      auto ring = std::make_unique<RingCapture>( interface, pcap_filter, min_snaplen, fanout_group );
+      ring->set_spin( runtime.spin() );
+      capture = std::move( ring );
+    } else {
+      capture = std::make_unique<PacketCapture>( interface, pcap_filter, min_snaplen, fanout_group );
+    }
+    if ( runtime.busy_poll().count() > 0 ) {
+      set_busy_poll( capture->socket_fd().value(), runtime.busy_poll() );
+    }
+    return capture;
+  };
+
+  auto make_sender = [&]( std::shared_ptr<batch_queue<CapturedPacket>> packets ) {
+    packets->set_spin( runtime.spin() );
+    auto sender = std::make_unique<SidekickSender>( quacking_interval,
+                                                    missing_packet_threshold,
+                                                    quack_checksum,
+                                                    epoch_packets,
+                                                    std::chrono::seconds( epoch_seconds ),
+                                                    packets );
+    set_adaptive_bounds( *sender );
+    sender->set_flow_limits( max_flows, std::chrono::seconds( flow_idle_seconds ) );
+    set_quack_budget( *sender, workers );
+    sender->set_report_interval( std::chrono::seconds( report_seconds ) );
+    sender->set_emission_timers( std::chrono::milliseconds( quack_ms ), std::chrono::milliseconds( silence_ms ) );
+    return sender;
+  };
 
-  PacketCapture capture( interface, pcap_filter );
-  SidekickSender sidekick( quacking_interval, missing_packet_threshold, capture.datagrams() );
+  // Offline benchmark: every packet goes through the same parsing and quACK updates on one thread, and we time
+  // each one. QuACKs are built but not sent, since the flows in the file aren't there to receive them.
+  if ( !replay_file.empty() ) {
+    ReplayCapture capture( replay_file, pcap_filter, replay_rate );
+    auto sidekick = make_sender( capture.packets() );
+    sidekick->set_dry_run( true );
+    capture.tick_every( SidekickSender::TIMER_TICK, [&] { sidekick->after_batch(); } );
 
-  std::thread sidekick_thread( [&] { sidekick.run(); } );
-  std::thread capture_thread( [&] { capture.run(); } );
+    Histogram latency;
+    capture.deliver_to( [&]( const CapturedPacket& packet ) {
+      auto started_at = std::chrono::steady_clock::now();
+      sidekick->handle_packet( packet );
+      latency.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - started_at )
+          .count() );
+    } );
 
-  sidekick_thread.join();
-  capture_thread.join();
+    auto started_at = std::chrono::steady_clock::now();
+    capture.run();
+    double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - started_at ).count();
+
+    std::cout << "Frames read: " << capture.frames_read() << std::endl;
+    std::cout << "Packets handled: " << sidekick->packets_handled() << " (" << sidekick->packets_handled() / elapsed
+              << " packets/s)" << std::endl;
+    std::cout << "QuACKs: " << sidekick->quacks_sent() << " (" << sidekick->quacks_sent() / elapsed << " quACKs/s)"
+              << std::endl;
+    std::cout << "QuACKs held back by the caps: " << sidekick->quacks_deferred() << ", folded into a held one: "
+              << sidekick->quacks_coalesced() << std::endl;
+    std::cout << "Per-packet latency (ns): p50 " << latency.percentile( 50 ) << ", p90 " << latency.percentile( 90 )
+              << ", p99 " << latency.percentile( 99 ) << ", p99.9 " << latency.percentile( 99.9 ) << ", max "
+              << latency.max() << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if ( workers == 1 ) {
+    auto capture = make_capture( {} );
+    auto sidekick = make_sender( capture->packets() );
+
+    std::thread sidekick_thread( [&] {
+      runtime.enter_thread( "sender" );
+      sidekick->run();
+    } );
+    std::thread capture_thread( [&] {
+      runtime.enter_thread( "capture" );
+      capture->run();
+    } );
+
+    sidekick_thread.join();
+    capture_thread.join();
+    return EXIT_SUCCESS;
+  }
+
+  // Each worker has its own socket in a fanout group, so the kernel always hands a flow to the same worker, which
+  // keeps that flow's state in its own sender. Packets are handled right on the capture thread: nothing is shared.
+  uint16_t fanout_group = getpid() & 0xffff;
+  std::vector<std::unique_ptr<Capture>> captures;
+  std::vector<std::unique_ptr<SidekickSender>> senders;
+  for ( size_t i = 0; i < workers; i++ ) {
+    captures.push_back( make_capture( fanout_group ) );
+    senders.push_back( make_sender( captures.back()->packets() ) );
+    captures.back()->deliver_to( [sender = senders.back().get()]( const CapturedPacket& packet ) {
+      sender->handle_packet( packet );
+    } );
+    captures.back()->tick_every( SidekickSender::TIMER_TICK,
+                                 [sender = senders.back().get()] { sender->after_batch(); } );
+  }
+
+  std::vector<std::thread> worker_threads;
+  for ( size_t i = 0; i < workers; i++ ) {
+    worker_threads.emplace_back( [&, i] {
+      runtime.enter_thread( "worker" + std::to_string( i ) );
+      captures[i]->run();
+    } );
+  }
+  for ( auto& thread : worker_threads ) {
+    thread.join();
+  }
 
   return EXIT_SUCCESS;
 }
\ No newline at end of file
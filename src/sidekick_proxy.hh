@@ -1,6 +1,15 @@
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <thread>
-#include <unordered_map>
+#include <type_traits>
+#include <vector>
 
 #include <linux/if_ether.h>
 #include <linux/ip.h>
@@ -8,38 +17,143 @@
 #include <pcap/pcap.h>
 
 #include "address.hh"
-#include "conqueue.hh"
+#include "batch_queue.hh"
+#include "flow_table.hh"
+#include "histogram.hh"
 #include "ipv4_datagram.hh"
+#include "packet_ring.hh"
 #include "parser.hh"
 #include "quack.hh"
 #include "sidekick_protocol.hh"
 #include "socket.hh"
+#include "timer_wheel.hh"
+#include "token_bucket.hh"
 
 static constexpr size_t ETH_HDR_LEN = sizeof( struct ethhdr );
 static constexpr size_t IP_HDR_LEN = sizeof( struct iphdr );
 static constexpr size_t UDP_HDR_LEN = sizeof( struct udphdr );
 
-class PacketCapture
+// Fragment offset bits of the IPv4 `frag_off` field
+static constexpr uint16_t IP_FRAG_OFFSET_MASK = 0x1fff;
+
+// Everything the proxy needs from a captured UDP packet, small enough to copy around by value
+struct CapturedPacket
+{
+  IPv4Address src;
+  IPv4Address dst;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint32_t packet_id;
+
+  // When the kernel captured the packet, in ns of CLOCK_REALTIME like pcap timestamps, or 0 if unknown
+  uint64_t captured_at_ns;
+};
+
+static_assert( sizeof( CapturedPacket ) == 24 && std::is_trivially_copyable_v<CapturedPacket> );
+
+// Pull the addresses, ports and packet id straight out of an Ethernet frame, without copying or checksumming it.
+// Frames that aren't unfragmented IPv4/UDP with a packet id are skipped.
+std::optional<CapturedPacket> parse_captured_packet( std::string_view frame, uint64_t captured_at_ns = 0 );
+
+// Current time on the clock capture timestamps use
+inline uint64_t realtime_ns()
+{
+  timespec ts;
+  clock_gettime( CLOCK_REALTIME, &ts );
+  return static_cast<uint64_t>( ts.tv_sec ) * 1'000'000'000 + ts.tv_nsec;
+}
+
+// Source of captured packets for the SidekickSender
+class Capture
+{
+protected:
+  static constexpr int PCAP_OPTIMIZE = 1;
+
+  // Enough of a frame to hold the longest IPv4 header, the UDP header and the packet id
+  static constexpr int MIN_SNAPLEN = ETH_HDR_LEN + 60 + UDP_HDR_LEN + QUACK_ID_OFFSET + sizeof( uint32_t );
+
+  // Most packets to collect before handing them over, when the capture has no natural batch boundary
+  static constexpr size_t MAX_BATCH = 256;
+
+  // Packets that have been filtered and parsed
+  std::shared_ptr<batch_queue<CapturedPacket>> packets_ { std::make_shared<batch_queue<CapturedPacket>>() };
+
+  // Packets parsed since the last flush()
+  std::vector<CapturedPacket> batch_ {};
+
+  // If set, packets are handled on the capture thread instead of being queued
+  std::function<void( const CapturedPacket& )> handler_ {};
+
+  // Handle `packet` now, or add it to the batch for the next flush()
+  void deliver( const CapturedPacket& packet )
+  {
+    if ( handler_ ) {
+      handler_( packet );
+    } else {
+      batch_.push_back( packet );
+    }
+  }
+
+  // Called after every batch, and at least every `tick_period_` while no packets arrive
+  std::function<void()> tick_handler_ {};
+  std::chrono::milliseconds tick_period_ {};
+
+  // Hand the batch over to the sender thread, with one lock and at most one wakeup, then run the tick handler
+  void flush()
+  {
+    packets_->push( batch_ );
+    if ( tick_handler_ ) {
+      tick_handler_();
+    }
+  }
+
+public:
+  static constexpr const char* DEFAULT_FILTER = "ip and udp";
+
+  Capture() { batch_.reserve( MAX_BATCH ); }
+  virtual ~Capture() = default;
+
+  // Capture packets until the process exits
+  virtual void run() = 0;
+
+  std::shared_ptr<batch_queue<CapturedPacket>> packets() { return packets_; }
+
+  // Run `handler` on every packet from the capture thread, rather than queueing them for another thread
+  void deliver_to( std::function<void( const CapturedPacket& )> handler ) { handler_ = std::move( handler ); }
+
+  // Also call `handler` from the capture thread at least every `period`, e.g. to drive timers in a sender that
+  // gets its packets through deliver_to()
+  void tick_every( std::chrono::milliseconds period, std::function<void()> handler )
+  {
+    tick_period_ = period;
+    tick_handler_ = std::move( handler );
+  }
+
+  // Socket the kernel delivers packets on, if there is one
+  virtual std::optional<int> socket_fd() const { return {}; }
+};
+
+// Captures through libpcap, handing over whatever each read from the kernel returns at once
+class PacketCapture : public Capture
 {
 private:
   static constexpr int PCAP_PROMISC = 1;
   static constexpr int PCAP_TIMEOUT = -1;
-  static constexpr int PCAP_OPTIMIZE = 1;
-
-  // Datagrams that have been filtered and parsed
-  std::shared_ptr<conqueue<IPv4Datagram>> datagrams_;
 
   // Interface name and opaque pcap pointer
   std::string interface_;
   pcap_t* pcap_handle_;
 
-  // Main packet callback function
+  // Main packet callback function, called for each packet in a batch
   static void packet_handler( u_char* user, const struct pcap_pkthdr* pkthdr, const u_char* packet );
 
 public:
-  static constexpr const char* DEFAULT_FILTER = "ip and udp";
-
-  PacketCapture( const std::string& interface, const std::string& filter );
+  // With `min_snaplen`, libpcap only copies the headers and packet id of each frame instead of all of it. With a
+  // `fanout_group`, packets are shared by flow with every other capture in the group.
+  PacketCapture( const std::string& interface,
+                 const std::string& filter,
+                 bool min_snaplen = false,
+                 std::optional<uint16_t> fanout_group = {} );
 
   ~PacketCapture()
   {
@@ -48,9 +162,125 @@ public:
     }
   };
 
-  void run();
-  
-  std::shared_ptr<conqueue<IPv4Datagram>> datagrams() { return datagrams_; }
+  void run() override;
+  std::optional<int> socket_fd() const override { return pcap_fileno( pcap_handle_ ); }
+};
+
+// Captures from a TPACKET_V3 ring, handing over the packets in each block at once
+class RingCapture : public Capture
+{
+private:
+  std::string interface_;
+  std::unique_ptr<PacketRing> ring_ {};
+
+  // Ring overruns are read from the kernel (one syscall) at most this often, and warned about when there are any
+  static constexpr std::chrono::seconds DROP_CHECK_INTERVAL { 1 };
+  std::chrono::steady_clock::time_point next_drop_check_ {};
+  uint64_t drops_ {};
+  void check_drops();
+
+public:
+  // Same filter syntax as PacketCapture, compiled with libpcap but run by the kernel on the ring's socket
+  RingCapture( const std::string& interface,
+               const std::string& filter,
+               bool min_snaplen = false,
+               std::optional<uint16_t> fanout_group = {} );
+
+  void run() override;
+  std::optional<int> socket_fd() const override { return ring_->fd(); }
+
+  // Watch the ring for this long before sleeping when it runs dry
+  void set_spin( std::chrono::steady_clock::duration spin ) { ring_->set_spin( spin ); }
+};
+
+// Replays a capture file (Ethernet link type) through the same parsing, as fast as possible or paced by the
+// recorded timestamps. `run()` returns at the end of the file.
+class ReplayCapture : public Capture
+{
+private:
+  std::string path_;
+  pcap_t* pcap_handle_;
+
+  // Speedup over the recorded timing, or 0 for as fast as possible
+  double rate_;
+
+  uint64_t frames_read_ {};
+
+public:
+  ReplayCapture( const std::string& path, const std::string& filter, double rate = 0 );
+
+  ~ReplayCapture()
+  {
+    if ( pcap_handle_ ) {
+      pcap_close( pcap_handle_ );
+    }
+  };
+
+  void run() override;
+
+  // Frames read from the file so far, including ones the filter or parser skipped
+  uint64_t frames_read() const { return frames_read_; }
+};
+
+// A UDP flow through the proxy (the protocol is always UDP)
+struct FlowKey
+{
+  IPv4Address src;
+  IPv4Address dst;
+  uint16_t src_port;
+  uint16_t dst_port;
+
+  bool operator==( const FlowKey& ) const = default;
+};
+
+struct FlowKeyHash
+{
+  size_t operator()( const FlowKey& key ) const
+  {
+    uint64_t ports = uint64_t { key.src_port } << 16 | key.dst_port;
+    uint64_t x = ( uint64_t { key.src } << 32 | key.dst ) ^ ( ports << 7 );
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+  }
+};
+
+struct IPv4AddressHash
+{
+  size_t operator()( IPv4Address address ) const { return FlowKeyHash {}( FlowKey { address, 0, 0, 0 } ); }
+};
+
+// quACK state the proxy keeps for each sender
+struct QuackFlow
+{
+  Quack quack;
+  std::chrono::steady_clock::time_point epoch_started_at {};
+
+  // Where quACKs go, built once from the numeric source address rather than resolved for every quACK
+  std::optional<Address> destination {};
+
+  // Ids received since the last emission, folded into `quack.power_sums` in one batch when it is sent
+  std::vector<uint32_t> pending_ids {};
+  std::vector<uint64_t> pending_captured_at_ns {};
+
+  // For emitting on time rather than packet count: whether the flow is in the timer wheel
+  std::chrono::steady_clock::time_point last_packet_at {};
+  std::chrono::steady_clock::time_point last_emitted_at {};
+  bool timer_armed {};
+
+  // When the kernel keeps the sums, they never reset, so an epoch is measured from where they stood when it began
+  std::vector<QuackInt> kernel_epoch_sums {};
+  uint32_t kernel_epoch_count {};
+
+  // Adapted to the receiver's feedback: packets per quACK (the threshold is in `quack`), the smoothed fraction of
+  // packets lost, and the most lost at one quACK, which fades slowly so the next burst still fits
+  size_t interval {};
+  double loss_rate {};
+  double burst {};
+
+  // Whether the flow's quACK is waiting for budget in the sender's queue
+  bool deferred {};
 };
 
 class SidekickSender
@@ -60,27 +290,206 @@ private:
   size_t quacking_packet_interval_;
   size_t missing_packet_threshold_;
 
-  // Datagrams captured by sniffer
-  std::shared_ptr<conqueue<IPv4Datagram>> datagrams_;
+  // Each flow's threshold and quACK interval adapt to the loss its receiver reports, within these bounds, starting
+  // from the two above. Equal bounds (the default) keep them fixed. Flows keep power sums up to the highest
+  // threshold, so it can go up at any time, but quACKs only carry as many as the current one.
+  size_t min_threshold_;
+  size_t max_threshold_;
+  size_t min_interval_;
+  size_t max_interval_;
+
+  // How much each report of loss moves a flow's loss rate, and how much of its burst size is kept per report
+  static constexpr double LOSS_SMOOTHING = 0.25;
+  static constexpr double BURST_DECAY = 0.9;
+
+  // Send one power sum beyond the threshold, so receivers can tell a bad decode from a good one
+  bool quack_checksum_;
+
+  // A flow's quACK state starts over once an epoch has covered this many ids, or has lasted this long
+  uint32_t epoch_packets_;
+  std::chrono::steady_clock::duration epoch_duration_;
+
+  // Packets captured by sniffer, and the batch being worked through
+  std::shared_ptr<batch_queue<CapturedPacket>> packets_;
+  std::vector<CapturedPacket> batch_ {};
 
-  // quACK state mapped to sender IPv4 addresses
-  std::unordered_map<IPv4Address, Quack> quacks_ {};
+  // quACK state for each flow. Flows idle for `flow_idle_timeout_` are dropped, and the least recently used ones
+  // make way for new ones once the table is full.
+  static constexpr size_t DEFAULT_MAX_FLOWS = 16384;
+  FlowTable<FlowKey, QuackFlow, FlowKeyHash> flows_ { DEFAULT_MAX_FLOWS };
+  std::chrono::steady_clock::duration flow_idle_timeout_ { std::chrono::minutes( 5 ) };
 
-  // Socket to send quACKs from proxy to sidekick receivers
+  // Socket to send quACKs from proxy to sidekick receivers. QuACKs are queued on it as they are built, and sent
+  // together by flush_quacks() after each batch of packets or tick.
   UDPSocket quacking_socket_ {};
 
+  // Number of quACKs in each sendmmsg() batch, since the last report
+  Histogram quack_batch_sizes_ {};
+
+  // Receivers' feedback comes back to the same socket
+  std::string feedback_ {};
+
+  // Build quACKs but don't send them, e.g. when replaying someone else's traffic
+  bool dry_run_ {};
+
+  uint64_t packets_handled_ {};
+  uint64_t quacks_sent_ {};
+
+  // Caps on the bytes a second of quACKs (counting IP and UDP headers) sent in all, and to any one receiver, if
+  // set; each receiver's bucket starts out as a copy of `destination_budget_`. A quACK over either cap waits its
+  // turn in `deferred_` instead of being dropped. Since each quACK supersedes the flow's last one, any built for
+  // the flow while it waits are folded into it: only the latest goes out.
+  std::optional<TokenBucket> quack_budget_ {};
+  std::optional<TokenBucket> destination_budget_ {};
+  std::optional<FlowTable<IPv4Address, TokenBucket, IPv4AddressHash>> destination_budgets_ {};
+  std::deque<FlowKey> deferred_ {};
+  uint64_t quacks_deferred_ {};
+  uint64_t quacks_coalesced_ {};
+
+  // Bursts allowed under the caps, though always enough for the largest quACK
+  static constexpr auto BUDGET_BURST = std::chrono::milliseconds( 20 );
+
+  // Besides every `interval` packets of its own, a flow with unreported ids is quACKed this long after its
+  // last quACK, and this long after its last packet, unless zero. Deadlines are kept in a timer wheel.
+  std::chrono::steady_clock::duration emit_interval_ {};
+  std::chrono::steady_clock::duration emit_after_silence_ {};
+  TimerWheel<FlowKey> timers_ { TIMER_TICK, std::chrono::steady_clock::now() };
+
+  // How often to print latency histograms, if at all
+  std::chrono::steady_clock::duration report_interval_ {};
+  std::chrono::steady_clock::time_point next_report_at_ {};
+
+  // How long timestamped packets waited from capture until the sender got to them, and until a quACK covering them
+  // went out, over all flows since the last report. A pair per flow would cost more than the flow itself.
+  Histogram process_latency_ {};
+  Histogram quack_latency_ {};
+
+  void report();
+
+  QuackFlow& flow( const FlowKey& key, std::chrono::steady_clock::time_point now );
+
+  // Fold the flow's pending ids into its quACK and send it
+  void emit_quack( const FlowKey& key, QuackFlow& flow, std::chrono::steady_clock::time_point now );
+  void fold_pending_ids( QuackFlow& flow, std::chrono::steady_clock::time_point now );
+
+  // When the flow's unreported ids are due out by time, if ever
+  std::chrono::steady_clock::time_point emission_deadline( const QuackFlow& flow ) const;
+
+  // Send the flow's current quACK, or hold it until the caps allow
+  void send_quack( const FlowKey& key, QuackFlow& flow, std::chrono::steady_clock::time_point now );
+
+  // Queue the flow's current quACK for flush_quacks() if the caps allow, and start a new epoch if this one is
+  // over. Returns whether it was queued.
+  bool transmit_quack( const FlowKey& key, QuackFlow& flow, std::chrono::steady_clock::time_point now );
+
+  // Whether `bytes` more of quACKs to `destination` fit under the caps at `now`, which spends them if so
+  bool within_budget( IPv4Address destination, size_t bytes, std::chrono::steady_clock::time_point now );
+
+  // Send the held quACKs that now fit under the caps, oldest first
+  void send_deferred( std::chrono::steady_clock::time_point now );
+
+  bool is_adaptive() const { return min_threshold_ < max_threshold_ || min_interval_ < max_interval_; }
+  void set_threshold( Quack& quack, size_t threshold ) const;
+
+  // Move the flow's threshold and interval towards what its receiver's latest feedback calls for
+  void adapt( QuackFlow& flow, const QuackFeedback& feedback );
+
 public:
+  // Resolution of time-driven emission
+  static constexpr auto TIMER_TICK = std::chrono::milliseconds( 1 );
+
   SidekickSender( size_t quacking_packet_interval,
                   size_t missing_packet_threshold,
-                  std::shared_ptr<conqueue<IPv4Datagram>> datagrams )
+                  bool quack_checksum,
+                  uint32_t epoch_packets,
+                  std::chrono::steady_clock::duration epoch_duration,
+                  std::shared_ptr<batch_queue<CapturedPacket>> packets )
     : quacking_packet_interval_( quacking_packet_interval )
     , missing_packet_threshold_( missing_packet_threshold )
-    , datagrams_( datagrams )
+    , min_threshold_( missing_packet_threshold )
+    , max_threshold_( missing_packet_threshold )
+    , min_interval_( quacking_packet_interval )
+    , max_interval_( quacking_packet_interval )
+    , quack_checksum_( quack_checksum )
+    , epoch_packets_( epoch_packets )
+    , epoch_duration_( epoch_duration )
+    , packets_( packets )
   {
+    if ( Quack::max_size( num_power_sums() ) > MAX_QUACK_SIZE ) {
+      throw std::runtime_error( "Too many power sums to fit a quACK in one datagram" );
+    }
     quacking_socket_.bind( Address( "0.0.0.0", 0 ) );
   };
 
   void run();
-  void handle_datagram( IPv4Datagram& datagram );
-  void update_quack( IPv4Address src_address, uint32_t packet_id );
-};
\ No newline at end of file
+  void handle_packet( const CapturedPacket& packet );
+  void update_quack( const FlowKey& key, uint32_t packet_id, uint64_t captured_at_ns = 0 );
+
+  void set_dry_run( bool dry_run ) { dry_run_ = dry_run; }
+
+  // Emit quACKs on time as well as packet count (zero to not): every `interval`, and once a flow goes `silence`
+  // without packets. Needs tick() to be called, which run() does.
+  void set_emission_timers( std::chrono::steady_clock::duration interval,
+                            std::chrono::steady_clock::duration silence )
+  {
+    emit_interval_ = interval;
+    emit_after_silence_ = silence;
+  }
+
+  bool has_emission_timers() const { return emit_interval_.count() > 0 || emit_after_silence_.count() > 0; }
+
+  // Emit every quACK that is due by `now`, at most TIMER_TICK late
+  void tick( std::chrono::steady_clock::time_point now );
+
+  // Keep state for at most `max_flows` flows, dropping any idle for `idle_timeout`. Starts the table over.
+  void set_flow_limits( size_t max_flows, std::chrono::steady_clock::duration idle_timeout )
+  {
+    flows_ = FlowTable<FlowKey, QuackFlow, FlowKeyHash>( max_flows );
+    flow_idle_timeout_ = idle_timeout;
+  }
+
+  // Print capture latency percentiles, the flow table's counters and quACK batch sizes, every
+  // `interval` (zero to never), and start over
+  void set_report_interval( std::chrono::steady_clock::duration interval )
+  {
+    report_interval_ = interval;
+    next_report_at_ = std::chrono::steady_clock::now() + interval;
+  }
+
+  // Send every quACK built since the last call in one go
+  void flush_quacks();
+
+  // Everything due between batches of packets: quACKs due on time, receiver feedback, and sending what was queued.
+  // run() calls it after each batch; when packets go through a capture's deliver_to(), its tick handler should.
+  void after_batch();
+
+  // Let each flow's threshold and packets per quACK range over [min, max] as its receiver reports loss. The
+  // initial values are clamped into range. Call before any packets are handled. Receivers only report loss when
+  // run with --feedback; flows without it keep their initial values.
+  void set_adaptive_bounds( size_t min_threshold, size_t max_threshold, size_t min_interval, size_t max_interval );
+
+  // Adapt flows to every piece of receiver feedback that has arrived, which run() does after each batch
+  void poll_feedback();
+
+  // Cap quACKs at `rate` bytes a second in all, and `destination_rate` to any one receiver (zero for no cap). Call
+  // after set_flow_limits() and set_adaptive_bounds().
+  void set_quack_budget( double rate, double destination_rate );
+
+  uint64_t packets_handled() const { return packets_handled_; }
+
+  // QuACKs built, whether or not they were actually sent
+  uint64_t quacks_sent() const { return quacks_sent_; }
+
+  // QuACKs held back by the caps, and ones folded into a quACK already held
+  uint64_t quacks_deferred() const { return quacks_deferred_; }
+  uint64_t quacks_coalesced() const { return quacks_coalesced_; }
+
+  // Number of power sums kept for each flow. QuACKs carry the first threshold of them (plus one with a checksum).
+  size_t num_power_sums() const { return max_threshold_ + ( quack_checksum_ ? 1 : 0 ); }
+
+  // Send a quACK from power sums accumulated elsewhere (by the kernel) over every id the flow ever sent
+  void update_quack_sums( IPv4Address src_address,
+                          std::span<const QuackInt> cumulative_sums,
+                          uint32_t cumulative_count,
+                          uint32_t last_received_id );
+};
@@ -1,10 +1,12 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
-#include <iostream>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <random>
 #include <shared_mutex>
+#include <span>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -16,8 +18,11 @@
 #include "conqueue.hh"
 #include "crypto.hh"
 #include "ipv4_datagram.hh"
+#include "log.hh"
 #include "parser.hh"
 #include "quack.hh"
+#include "quack_decoder.hh"
+#include "runtime.hh"
 #include "sidekick_protocol.hh"
 #include "socket.hh"
 #include "webrtc_protocol.hh"
@@ -48,16 +53,37 @@ private:
   uint16_t quack_port_ {};
   size_t missing_packet_threshold_ {};
 
-  // Mapping between sequence numbers and encrypted packets (TODO: maybe clear these out after X seconds?)
+  // Whether quACKs carry an extra power sum to check decodes against
+  bool quack_checksum_ {};
+
+  // Mapping between sequence numbers and encrypted packets
   std::unordered_map<uint32_t, std::string> sent_data_ {};
 
   // Mapping between opaque quack (packet) identifiers and seqnos
   std::unordered_map<uint32_t, uint32_t> packet_ids_to_seqnos_ {};
 
-  // In-order packet ids that have been (re-)transmitted
+  // In-order packet ids that have been (re-)transmitted. Positions count every id ever sent, but ids from before
+  // the previous quACK epoch are discarded, so the first one kept is at position sent_packet_ids_offset_.
   std::vector<uint32_t> sent_packet_ids_ {};
+  size_t sent_packet_ids_offset_ {};
+
+  // Position of each packet id in sent_packet_ids_, so a quACK can be aligned without scanning
+  std::unordered_map<uint32_t, size_t> packet_id_positions_ {};
+
+  // What quACKs have shown since it was last sent back to the proxy, so it can adapt this flow's threshold and how
+  // often it is quACKed. Only sent when asked for, as a proxy that doesn't adapt has no use for it.
+  static constexpr auto FEEDBACK_INTERVAL = std::chrono::milliseconds( 100 );
+  bool send_feedback_ {};
+  QuackFeedback feedback_ {};
+  std::chrono::steady_clock::time_point feedback_sent_at_ {};
 
-  // Protects sent_data_, packet_ids_to_seqnos_, sent_packet_ids_ (the above three fields)
+  // Current quACK epoch, the position it starts at, and the position of the first packet not yet covered by a
+  // quACK in it
+  uint32_t epoch_ {};
+  size_t epoch_start_idx_ {};
+  size_t next_unquacked_idx_ {};
+
+  // Protects all of the above since sent_data_
   std::mutex receiver_lock_ {};
 
 public:
@@ -66,29 +92,115 @@ public:
                 Address server_address,
                 AudioBuffer& buffer,
                 uint64_t send_frequency,
-                size_t missing_packet_threshold = 8 )
+                size_t missing_packet_threshold = 8,
+                bool quack_checksum = false )
     : client_port_( client_port )
     , quack_port_( quack_port )
     , webrtc_server_address_( server_address )
     , input_buffer_( buffer )
     , send_frequency_( send_frequency )
     , missing_packet_threshold_( missing_packet_threshold )
+    , quack_checksum_( quack_checksum )
   {
     client_socket_.bind( Address( "0.0.0.0", client_port ) );
     quack_socket_.bind( Address( "0.0.0.0", quack_port ) );
+
+    feedback_.src_port = client_port;
+    feedback_.dst = server_address.ipv4_numeric();
+    feedback_.dst_port = server_address.port();
+  }
+
+  // Send feedback on the quACKs back to the proxy, for one that adapts each flow's threshold and interval to it
+  void enable_feedback() { send_feedback_ = true; }
+
+  // Spin and busy-poll on the NACK and quACK sockets, as the runtime options ask
+  void set_low_latency( const Runtime& runtime )
+  {
+    for ( auto socket : { &client_socket_, &quack_socket_ } ) {
+      socket->set_spin( runtime.spin() );
+      socket->set_busy_poll( runtime.busy_poll() );
+    }
+  }
+
+  // Append to the in-order packet ids, pointing the id's position at this copy. An id is only sent again once the
+  // earlier copy looks lost, so this is the one the proxy reports from now on (caller must hold receiver_lock_).
+  void record_sent_packet_id( uint32_t packet_id )
+  {
+    size_t position = sent_packet_ids_offset_ + sent_packet_ids_.size();
+    packet_id_positions_[packet_id] = position;
+    sent_packet_ids_.push_back( packet_id );
+  }
+
+  // Sent packet ids at positions [begin, end) (caller must hold receiver_lock_, and the span is only valid until
+  // the next packet is sent)
+  std::span<const uint32_t> sent_packet_ids( size_t begin, size_t end ) const
+  {
+    return std::span<const uint32_t>( sent_packet_ids_ ).subspan( begin - sent_packet_ids_offset_, end - begin );
+  }
+
+  // Count `missing` packets found by one quACK towards the next feedback (caller must hold receiver_lock_)
+  void record_missing( uint32_t missing )
+  {
+    feedback_.missing += missing;
+    feedback_.max_missing = std::max( feedback_.max_missing, missing );
+  }
+
+  // Send the feedback gathered so far to the proxy and start over (caller must hold receiver_lock_)
+  void send_feedback( const Address& proxy_address )
+  {
+    FixedSerializer<32> serializer;
+    feedback_.serialize( serializer );
+    quack_socket_.sendto( serializer.output(), proxy_address );
+
+    feedback_.packets = feedback_.missing = feedback_.max_missing = feedback_.overflows = 0;
+    feedback_sent_at_ = std::chrono::steady_clock::now();
+  }
+
+  // Move on to quACK epoch `epoch`, which starts at position `start_idx`. Packets from before the epoch that just
+  // closed are forgotten; the closed one is kept so that NACKs for it can still be served (caller must hold
+  // receiver_lock_)
+  void start_epoch( uint32_t epoch, size_t start_idx )
+  {
+    size_t discard_end = epoch_start_idx_;
+    for ( size_t i = sent_packet_ids_offset_; i < discard_end; i++ ) {
+      uint32_t packet_id = sent_packet_ids_[i - sent_packet_ids_offset_];
+      auto position = packet_id_positions_.find( packet_id );
+
+      // Keep ids that were sent again later on
+      if ( position == packet_id_positions_.end() || position->second >= discard_end ) {
+        continue;
+      }
+      packet_id_positions_.erase( position );
+
+      auto seqno = packet_ids_to_seqnos_.find( packet_id );
+      if ( seqno != packet_ids_to_seqnos_.end() ) {
+        sent_data_.erase( seqno->second );
+        packet_ids_to_seqnos_.erase( seqno );
+      }
+    }
+
+    if ( discard_end > sent_packet_ids_offset_ ) {
+      sent_packet_ids_.erase( sent_packet_ids_.begin(),
+                              sent_packet_ids_.begin() + ( discard_end - sent_packet_ids_offset_ ) );
+      sent_packet_ids_offset_ = discard_end;
+    }
+
+    epoch_ = epoch;
+    epoch_start_idx_ = start_idx;
+    next_unquacked_idx_ = start_idx;
   }
 
   // Retransmit a packet based on its sequence number (caller must hold receiver_lock_)
   void retransmit( uint32_t seqno, uint32_t packet_id )
   {
-    sent_packet_ids_.push_back( packet_id );
+    record_sent_packet_id( packet_id );
     client_socket_.sendto( sent_data_[seqno], webrtc_server_address_ );
   }
 
   // Listening thread
   void receive_nacks()
   {
-    std::cerr << "WebRTCClient listening for NACKs on port " << client_port_ << std::endl;
+    LOG_INFO( "WebRTCClient listening for NACKs on port ", client_port_ );
 
     while ( true ) {
       std::string payload;
@@ -100,7 +212,8 @@ public:
       std::optional<std::string> seqno = decrypt( nonce, ciphertext );
 
       if ( !seqno.has_value() ) {
-        std::cerr << "Unable to decrypt NACK" << std::endl;
+        LOG_WARN( "Unable to decrypt NACK" );
+        continue;
       }
 
       uint32_t seqno_val = str_to_uint<uint32_t>( seqno.value() );
@@ -108,9 +221,16 @@ public:
       {
         std::unique_lock lk( receiver_lock_ );
 
+        // The packet may have been discarded along with an old quACK epoch
+        auto data = sent_data_.find( seqno_val );
+        if ( data == sent_data_.end() ) {
+          LOG_DEBUG( "Ignoring NACK for forgotten seqno: ", seqno_val );
+          continue;
+        }
+
         // Get the packet id that corresponds to this sequence number
-        std::optional<uint32_t> packet_id = get_packet_id( sent_data_[seqno_val] );
-        std::cerr << "Retransmitting packet for seqno based on NACK: " << seqno_val << std::endl;
+        std::optional<uint32_t> packet_id = get_packet_id( data->second );
+        LOG_DEBUG( "Retransmitting packet for seqno based on NACK: ", seqno_val );
         retransmit( seqno_val, packet_id.value() );
       }
     }
@@ -118,8 +238,7 @@ public:
 
   void send_packets()
   {
-    std::cerr << "WebRTCClient starting to send audio from port " << client_port_ << " to "
-              << webrtc_server_address_.ip() << ":" << webrtc_server_address_.port() << std::endl;
+    LOG_INFO( "WebRTCClient starting to send audio from port ", client_port_, " to ", webrtc_server_address_ );
 
     // The client sends a numbered packet containing 240 bytes of data every 20 milliseconds
     while ( true ) {
@@ -135,7 +254,7 @@ public:
       std::string payload = webrtc_serialize( next_seqno_, data );
       std::optional<uint32_t> packet_id = get_packet_id( payload );
       if ( !packet_id.has_value() ) {
-        std::cerr << "Audio payload doesn't have enough data to obtain packet identifier" << std::endl;
+        LOG_WARN( "Audio payload doesn't have enough data to obtain packet identifier" );
         continue;
       }
 
@@ -143,7 +262,8 @@ public:
         std::unique_lock lk( receiver_lock_ );
         sent_data_[next_seqno_] = payload;                      // Keep track of payload for future retransmission
         packet_ids_to_seqnos_[packet_id.value()] = next_seqno_; // For Sidekick-mediated retransmission
-        sent_packet_ids_.push_back( packet_id.value() );        // Add this packet id to the in-order ids sent
+        record_sent_packet_id( packet_id.value() );             // Add this packet id to the in-order ids sent
+        feedback_.packets++;
       }
 
       next_seqno_++;
@@ -153,52 +273,198 @@ public:
 
   void receive_quacks()
   {
-    std::cerr << "SidekickReceiver started" << std::endl;
+    LOG_INFO( "SidekickReceiver started" );
 
-    PowerSums running_sums( missing_packet_threshold_ );
-    size_t next_unquacked_idx = 0;
+    QuackDecoder decoder( missing_packet_threshold_, quack_checksum_ );
+    PowerSums running_sums( decoder.num_sums() );
     uint32_t num_missing = 0;
 
+    // How many of `running_sums` can be trusted. Resynchronizing from a quACK with a lower threshold leaves the
+    // sums past it behind, until a quACK that carries them decodes against the rest.
+    size_t valid_sums = running_sums.size();
+    uint32_t num_resyncs = 0;
+
+    // Sent ids from here to `next_unquacked_idx_` are in `running_sums` but no decode has confirmed the proxy got
+    // them. A resync forgets them, so that retransmitting one counts it again, as the proxy will.
+    size_t first_unconfirmed_idx = 0;
+
     while ( true ) {
       std::string payload;
       Address proxy_address = quack_socket_.recvfrom( payload );
 
       Quack received_quack;
       if ( !parse( received_quack, { payload } ) ) {
-        std::cerr << "Unable to parse quack" << std::endl;
+        LOG_WARN( "Unable to parse quack" );
+        continue;
+      }
+
+      // The proxy may send fewer sums than we keep, but not more
+      bool is_id_list = received_quack.encoding == QuackEncoding::IdList;
+      if ( !is_id_list && !decoder.accepts( received_quack ) ) {
+        LOG_WARN( "Ignoring quack with threshold ",
+                  received_quack.threshold,
+                  " and ",
+                  received_quack.power_sums.size(),
+                  " power sums, expected at most threshold ",
+                  decoder.threshold() );
         continue;
       }
 
       std::unique_lock lk( receiver_lock_ );
 
-      // Calculate power sums from sender's side (set of all sent packets)
-      size_t first_quacked_idx = next_unquacked_idx;
-      for ( size_t i = next_unquacked_idx; i < sent_packet_ids_.size(); i++ ) {
-        running_sums.add( sent_packet_ids_[i] );
-        if ( sent_packet_ids_[i] == received_quack.last_received_id ) {
-          next_unquacked_idx = i + 1;
-          break;
+      if ( send_feedback_ && std::chrono::steady_clock::now() - feedback_sent_at_ >= FEEDBACK_INTERVAL ) {
+        send_feedback( proxy_address );
+      }
+
+      // An older epoch is either a stale quACK, which aligns behind what we've covered, or the proxy starting over
+      // from epoch 0 (it restarted, or dropped the flow). Its sums then cover an unknown stretch up to its last id,
+      // so take them over from just past that id, as on a resync.
+      if ( received_quack.epoch < epoch_ ) {
+        auto position = packet_id_positions_.find( received_quack.last_received_id );
+        if ( is_id_list || position == packet_id_positions_.end() || position->second < next_unquacked_idx_ ) {
+          continue;
         }
+
+        num_resyncs++;
+        LOG_INFO( "Proxy started over at quack epoch ",
+                  received_quack.epoch,
+                  " from ",
+                  epoch_,
+                  ", resynchronizing, total resyncs: ",
+                  num_resyncs );
+        start_epoch( received_quack.epoch, position->second + 1 );
+        running_sums.clear();
+        running_sums.overwrite( received_quack.power_sums, received_quack.num_received );
+        valid_sums = received_quack.power_sums.size();
+        first_unconfirmed_idx = next_unquacked_idx_;
+        continue;
       }
 
-      std::cerr << "Received quack from: " << proxy_address.ip() << ":" << proxy_address.port() << "\n"
-                << "num_received: " << received_quack.num_received << "\n"
-                << "last_received_id: " << received_quack.last_received_id << "\n"
-                << "power_sums: " << received_quack.power_sums << "\n"
-                << "local power sums: " << running_sums << "\n"
-                << "total packets missing: " << num_missing << "\n"
-                << std::endl;
-
-      // Derive polynomial with coefficients from difference of power sums, and find roots (missing packets)
-      Polynomial diff_poly( running_sums.difference( received_quack.power_sums ) );
-      for ( size_t i = first_quacked_idx; i < next_unquacked_idx; i++ ) {
-        uint32_t packet_id = sent_packet_ids_[i];
-        if ( diff_poly.eval( packet_id ) == 0 ) {
-          std::cerr << "Retransmitting based on quACK, seqno: " << packet_ids_to_seqnos_[packet_id] << " packet_id: " << packet_id << std::endl;
-          retransmit( packet_ids_to_seqnos_[packet_id], packet_id );
-          running_sums.remove( packet_id );
-          num_missing++;
+      // The proxy started over: everything we sent after its last id of the previous epoch belongs to this one
+      if ( received_quack.epoch > epoch_ ) {
+        auto boundary = packet_id_positions_.find( received_quack.epoch_boundary_id );
+        if ( boundary == packet_id_positions_.end() || boundary->second + 1 < epoch_start_idx_ ) {
+          LOG_INFO( "Unable to find start of quack epoch ", received_quack.epoch );
+          continue;
         }
+
+        start_epoch( received_quack.epoch, boundary->second + 1 );
+        running_sums.clear();
+        valid_sums = running_sums.size();
+        first_unconfirmed_idx = next_unquacked_idx_;
+      }
+
+      // An id list only covers what arrived since the proxy's last power sums, so it's no use if we missed those
+      if ( is_id_list && running_sums.count() < received_quack.list_base_count ) {
+        continue;
+      }
+
+      // Align on the proxy's last received packet; anything at or before what we've already covered is stale
+      auto position = packet_id_positions_.find( received_quack.last_received_id );
+      if ( position == packet_id_positions_.end() || position->second < next_unquacked_idx_ ) {
+        LOG_DEBUG( "Ignoring stale quack with last_received_id=", received_quack.last_received_id );
+        continue;
+      }
+
+      // Bring the power sums from sender's side (set of all sent packets) up to the proxy's last received packet
+      // (retransmitting appends to sent_packet_ids_, so `candidates` is only valid until then)
+      size_t first_quacked_idx = next_unquacked_idx_;
+      next_unquacked_idx_ = position->second + 1;
+      auto candidates = sent_packet_ids( first_quacked_idx, next_unquacked_idx_ );
+      running_sums.add_batch( candidates );
+
+      // Nothing went missing: the proxy has folded in as many ids as we have (the first power sum guards against
+      // reordering making up for a loss), so there is nothing to decode
+      if ( received_quack.num_received == running_sums.count()
+           && ( is_id_list || running_sums.size() == 0 || running_sums[0] == received_quack.power_sums[0] ) ) {
+        if ( !is_id_list && received_quack.power_sums.size() > valid_sums ) {
+          running_sums.overwrite( received_quack.power_sums, running_sums.count() );
+          valid_sums = received_quack.power_sums.size();
+        }
+        first_unconfirmed_idx = next_unquacked_idx_;
+        continue;
+      }
+
+      LOG_DEBUG( "Received quack from ",
+                 proxy_address,
+                 " epoch=",
+                 received_quack.epoch,
+                 " encoding=",
+                 is_id_list ? "id list" : "power sums",
+                 " num_received=",
+                 received_quack.num_received,
+                 " last_received_id=",
+                 received_quack.last_received_id,
+                 " received_ids=",
+                 received_quack.received_ids.size(),
+                 " total_missing=",
+                 num_missing,
+                 " power_sums=",
+                 received_quack.power_sums );
+
+      // Past `valid_sums`, ours can't be compared with the proxy's, so decode as if it had sent a lower threshold
+      bool beyond_valid = !is_id_list && received_quack.power_sums.size() > valid_sums;
+      std::optional<Quack> trusted_quack;
+      if ( beyond_valid ) {
+        trusted_quack = received_quack.truncated( valid_sums - ( quack_checksum_ ? 1 : 0 ), valid_sums );
+      }
+      const Quack& decodable = trusted_quack ? *trusted_quack : received_quack;
+
+      // Either derive polynomial with coefficients from difference of power sums and find roots (missing packets),
+      // or look for the ids that weren't listed
+      auto missing = is_id_list ? decoder.decode_list( running_sums, received_quack, candidates )
+                                : decoder.decode( running_sums, decodable, candidates );
+
+      // A list carries no sums to resynchronize with, but the next power sums will disagree with ours and do it
+      if ( !missing.has_value() && is_id_list ) {
+        LOG_DEBUG( "Unable to decode id list (",
+                   running_sums.count(),
+                   " sent, ",
+                   received_quack.num_received,
+                   " received), waiting for power sums" );
+        continue;
+      }
+
+      // Too many losses, or sums we can't explain: retransmitting whatever happens to be a root would only waste
+      // uplink. Take over the proxy's state so the next quACK decodes against it, and leave these losses to NACKs.
+      if ( !missing.has_value() ) {
+        num_resyncs++;
+        if ( decoder.last_failure() == QuackDecoder::Failure::Overflow ) {
+          feedback_.overflows++;
+          record_missing( running_sums.count() - received_quack.num_received );
+        }
+        LOG_INFO( "Unable to decode quack (",
+                  decoder.last_failure() == QuackDecoder::Failure::Overflow ? "over threshold" : "inconsistent",
+                  ", ",
+                  running_sums.count(),
+                  " sent, ",
+                  received_quack.num_received,
+                  " received), resynchronizing, total resyncs: ",
+                  num_resyncs );
+        running_sums.overwrite( received_quack.power_sums, received_quack.num_received );
+        running_sums.forget( sent_packet_ids( first_unconfirmed_idx, next_unquacked_idx_ ) );
+        valid_sums = received_quack.power_sums.size();
+        first_unconfirmed_idx = next_unquacked_idx_;
+        continue;
+      }
+
+      LOG_DEBUG( "Decoded quack in ", decoder.last_decode_time().count(), " ns, missing: ", missing->size() );
+      record_missing( missing->size() );
+      first_unconfirmed_idx = next_unquacked_idx_;
+
+      // The decoder owns `missing`, so retransmitting can't invalidate it
+      for ( uint32_t packet_id : *missing ) {
+        LOG_DEBUG(
+          "Retransmitting based on quACK, seqno: ", packet_ids_to_seqnos_[packet_id], " packet_id: ", packet_id );
+        retransmit( packet_ids_to_seqnos_[packet_id], packet_id );
+        running_sums.remove( packet_id );
+        num_missing++;
+      }
+
+      // Now that ours match the proxy's, take over the sums we had lost track of
+      if ( beyond_valid ) {
+        running_sums.overwrite( received_quack.power_sums, running_sums.count() );
+        valid_sums = received_quack.power_sums.size();
       }
     }
   }
@@ -224,6 +490,11 @@ int main( int argc, char* argv[] )
   uint64_t audio_duration = 20;       // 20 seconds
   uint64_t audio_sample_size = 240;   // 240 bytes
 
+  // Must match the proxy's quACK settings
+  size_t missing_packet_threshold = 8;
+  bool quack_checksum = false;
+  bool quack_feedback = false;
+
   app.add_option( "-i,--server-ip", server_ip, "IP address of server" )->capture_default_str();
   app.add_option( "-p,--server-port", server_port, "Server port to send audio data to" )->capture_default_str();
   app.add_option( "-c,--client-port", client_port, "Port to send audio data from" )->capture_default_str();
@@ -240,12 +511,34 @@ int main( int argc, char* argv[] )
       "-s,--sample-size", audio_sample_size, "The size of each audio sample in bytes, if no audio file specified" )
     ->capture_default_str();
 
+  app
+    .add_option(
+      "-t,--threshold", missing_packet_threshold, "Missing packet threshold, the most the proxy may adapt it to" )
+    ->capture_default_str();
+  app.add_flag( "--checksum", quack_checksum, "Expect an extra power sum in quACKs to validate decodes" );
+  app.add_flag( "--feedback", quack_feedback, "Send quACK feedback, for a proxy that adapts to it" );
+
+  Runtime runtime;
+  runtime.add_options( app, "send, nack, quack" );
+  add_log_options( app );
+
   CLI11_PARSE( app, argc, argv );
+  runtime.start();
 
   crypto_init();
 
   AudioBuffer buffer;
-  WebRTCClient client( client_port, quack_port, Address( server_ip, server_port ), buffer, audio_send_frequency );
+  WebRTCClient client( client_port,
+                       quack_port,
+                       Address( server_ip, server_port ),
+                       buffer,
+                       audio_send_frequency,
+                       missing_packet_threshold,
+                       quack_checksum );
+  client.set_low_latency( runtime );
+  if ( quack_feedback ) {
+    client.enable_feedback();
+  }
 
   std::thread audio_thread( [&]() {
     // Load an audio file or read from /dev/urandom
@@ -258,9 +551,18 @@ int main( int argc, char* argv[] )
     }
   } );
 
-  std::thread nack_thread( [&] { client.receive_nacks(); } );
-  std::thread send_thread( [&] { client.send_packets(); } );
-  std::thread quack_thread( [&] { client.receive_quacks(); } );
+  std::thread nack_thread( [&] {
+    runtime.enter_thread( "nack" );
+    client.receive_nacks();
+  } );
+  std::thread send_thread( [&] {
+    runtime.enter_thread( "send" );
+    client.send_packets();
+  } );
+  std::thread quack_thread( [&] {
+    runtime.enter_thread( "quack" );
+    client.receive_quacks();
+  } );
 
   audio_thread.join();
   nack_thread.join();
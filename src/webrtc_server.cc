@@ -4,6 +4,8 @@
 
 #include "cli11.hh"
 #include "jitter_buffer.hh"
+#include "log.hh"
+#include "runtime.hh"
 #include "socket.hh"
 #include "webrtc_protocol.hh"
 
@@ -28,9 +30,16 @@ public:
     socket_.bind( Address( "0.0.0.0", port ) );
   }
 
+  // Spin and busy-poll on the listening socket, as the runtime options ask
+  void set_low_latency( const Runtime& runtime )
+  {
+    socket_.set_spin( runtime.spin() );
+    socket_.set_busy_poll( runtime.busy_poll() );
+  }
+
   void listen( uint64_t num_expected_seqnos )
   {
-    std::cerr << "WebRTCServer started, listening on port " << port_ << std::endl;
+    LOG_INFO( "WebRTCServer started, listening on port ", port_ );
 
     while ( 1 ) {
       std::string payload;
@@ -43,8 +52,7 @@ public:
       }
 
       auto [seqno, data] = parse_result.value();
-      std::cerr << "Received data from: " << client_address.ip() << ":" << client_address.port()
-                << ", seqno: " << seqno << ", length: " << data.length() << std::endl;
+      LOG_DEBUG( "Received data from ", client_address, ", seqno: ", seqno, ", length: ", data.length() );
 
       // Insert into jitter buffer
       buffer_.push( seqno, data );
@@ -55,7 +63,7 @@ public:
         time_point_t last_nack = missing_seqno.second;
 
         if ( rtt_ < duration_cast<milliseconds>( now - last_nack ).count() ) {
-          std::cerr << "Sending NACK for seqno: " << missing_seqno.first << std::endl;
+          LOG_DEBUG( "Sending NACK for seqno: ", missing_seqno.first );
 
           auto [nonce, ct] = encrypt( uint_to_str( missing_seqno.first ) );
           socket_.sendto( nonce + ct, client_address );
@@ -66,7 +74,7 @@ public:
       }
 
       if ( buffer_.received_packets().size() == num_expected_seqnos ) {
-        std::cerr << "WebRTCServer received every sequence number, listener is exiting..." << std::endl;
+        LOG_INFO( "WebRTCServer received every sequence number, listener is exiting..." );
         dump_buffer_statistics();
         break;
       }
@@ -108,16 +116,28 @@ int main( int argc, char* argv[] )
   app.add_option( "-f,--frequency", audio_send_frequency, "How often a packet the client sends server a packet in milliseconds" )->capture_default_str();
   app.add_option( "-d,--duration", audio_duration, "The length of the audio stream in seconds" )->capture_default_str();
 
+  Runtime runtime;
+  runtime.add_options( app, "listen, drain" );
+  add_log_options( app );
+
   CLI11_PARSE( app, argc, argv );
+  runtime.start();
 
   // Initialize crypto library
   crypto_init();
 
   WebRTCServer server( port, rtt );
+  server.set_low_latency( runtime );
 
   uint64_t num_seqnos = ( 1000 / audio_send_frequency ) * audio_duration;
-  std::thread listen_thread( [&] { server.listen( num_seqnos ); } );
-  std::thread play_thread( [&] { server.drain(); } );
+  std::thread listen_thread( [&] {
+    runtime.enter_thread( "listen" );
+    server.listen( num_seqnos );
+  } );
+  std::thread play_thread( [&] {
+    runtime.enter_thread( "drain" );
+    server.drain();
+  } );
 
   listen_thread.join();
   play_thread.join();
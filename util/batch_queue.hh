@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "runtime.hh"
+
+// Thread-safe queue that is filled and drained a batch at a time, so each side takes the lock once per batch
+// rather than once per item. Batches are handed over by swapping vectors, so once the buffers on either side have
+// grown to the usual batch size, nothing is allocated or copied item by item on the consumer's side.
+template<typename T>
+class batch_queue
+{
+private:
+  std::vector<T> inner_ {};
+  std::mutex lock_ {};
+  std::condition_variable non_empty_cv_ {};
+
+  // Lets the consumer spin without taking the lock
+  std::atomic<bool> non_empty_ {};
+
+  // How long the consumer spins on an empty queue before sleeping
+  std::chrono::steady_clock::duration spin_ {};
+
+public:
+  void set_spin( std::chrono::steady_clock::duration spin ) { spin_ = spin; }
+
+  // Append `items` to the queue and leave `items` empty (but not necessarily without capacity)
+  void push( std::vector<T>& items )
+  {
+    if ( items.empty() ) {
+      return;
+    }
+
+    bool was_empty;
+    {
+      std::unique_lock lk( lock_ );
+      was_empty = inner_.empty();
+      if ( was_empty ) {
+        inner_.swap( items );
+      } else {
+        inner_.insert( inner_.end(), items.begin(), items.end() );
+      }
+      non_empty_.store( true, std::memory_order_release );
+    }
+    items.clear();
+
+    // The consumer only ever waits on an empty queue
+    if ( was_empty ) {
+      non_empty_cv_.notify_one();
+    }
+  }
+
+  // Block until there is at least one item, then replace the contents of `items` with everything queued.
+  // Whatever was in `items` is discarded, and its buffer is reused for the next batch.
+  void pop_all( std::vector<T>& items )
+  {
+    items.clear();
+    spin_until( [&] { return non_empty_.load( std::memory_order_acquire ); }, spin_ );
+
+    std::unique_lock lk( lock_ );
+    while ( inner_.empty() ) {
+      non_empty_cv_.wait( lk );
+    }
+    inner_.swap( items );
+    non_empty_.store( false, std::memory_order_relaxed );
+  }
+
+  // Like pop_all(), but give up after `timeout`. Returns whether there were any items.
+  bool pop_all_for( std::vector<T>& items, std::chrono::steady_clock::duration timeout )
+  {
+    items.clear();
+    spin_until( [&] { return non_empty_.load( std::memory_order_acquire ); }, std::min( spin_, timeout ) );
+
+    std::unique_lock lk( lock_ );
+    if ( !non_empty_cv_.wait_for( lk, timeout, [&] { return !inner_.empty(); } ) ) {
+      return false;
+    }
+    inner_.swap( items );
+    non_empty_.store( false, std::memory_order_relaxed );
+    return true;
+  }
+
+  size_t size()
+  {
+    std::unique_lock lk( lock_ );
+    return inner_.size();
+  }
+};
@@ -14,7 +14,7 @@ private:
   std::condition_variable non_empty_cv_ {};
 
 public:
-  void push( T& item )
+  void push( const T& item )
   {
     std::unique_lock lk( lock_ );
     inner_.push( item );
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// Fixed-capacity table of per-flow state. Every entry is allocated up front (values are only constructed while in
+// use), so memory is capped however many flows show up: once it is full, the least recently used flow makes room
+// for a new one. Lookups probe a compact open-addressed index of (hash, entry) pairs, kept at most half full, so
+// they usually touch one cache line of it plus the entry itself. Removal shifts later slots back instead of leaving
+// tombstones.
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlowTable
+{
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  struct Counters
+  {
+    uint64_t lookups;
+    uint64_t probes;      // Index slots looked at, over all lookups
+    uint64_t inserts;
+    uint64_t evictions;   // Flows dropped to make room for new ones
+    uint64_t expirations; // Flows dropped for being idle
+  };
+
+private:
+  static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+  struct Slot
+  {
+    uint32_t hash;
+    uint32_t entry { NONE };
+  };
+
+  struct Entry
+  {
+    Key key {};
+    std::optional<Value> value {};
+    time_point last_used {};
+
+    // Neighbours in the recency list
+    uint32_t newer { NONE };
+    uint32_t older { NONE };
+  };
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> free_ {};
+
+  // Most and least recently used entries
+  uint32_t newest_ { NONE };
+  uint32_t oldest_ { NONE };
+
+  Counters counters_ {};
+
+  static uint32_t hash( const Key& key ) { return static_cast<uint32_t>( Hash {}( key ) ); }
+
+  // Slot holding `key`, or the empty slot where it would go. Only lookups from outside are counted.
+  size_t probe( const Key& key, uint32_t h, bool count = true )
+  {
+    counters_.lookups += count;
+    size_t i = h & mask_;
+    while ( true ) {
+      counters_.probes += count;
+      const Slot& slot = slots_[i];
+      if ( slot.entry == NONE || ( slot.hash == h && entries_[slot.entry].key == key ) ) {
+        return i;
+      }
+      i = ( i + 1 ) & mask_;
+    }
+  }
+
+  void unlink( uint32_t e )
+  {
+    Entry& entry = entries_[e];
+    ( entry.newer == NONE ? newest_ : entries_[entry.newer].older ) = entry.older;
+    ( entry.older == NONE ? oldest_ : entries_[entry.older].newer ) = entry.newer;
+    entry.newer = entry.older = NONE;
+  }
+
+  void link_newest( uint32_t e )
+  {
+    Entry& entry = entries_[e];
+    entry.older = newest_;
+    entry.newer = NONE;
+    if ( newest_ != NONE ) {
+      entries_[newest_].newer = e;
+    } else {
+      oldest_ = e;
+    }
+    newest_ = e;
+  }
+
+  // Empty slot `i`, moving back any later entries that would no longer be reachable from their home slot
+  void erase_slot( size_t i )
+  {
+    size_t j = i;
+    while ( true ) {
+      j = ( j + 1 ) & mask_;
+      if ( slots_[j].entry == NONE ) {
+        break;
+      }
+      size_t home = slots_[j].hash & mask_;
+      bool home_after_hole = i < j ? ( home > i && home <= j ) : ( home > i || home <= j );
+      if ( !home_after_hole ) {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+    slots_[i].entry = NONE;
+  }
+
+  void remove( uint32_t e )
+  {
+    Entry& entry = entries_[e];
+    erase_slot( probe( entry.key, hash( entry.key ), false ) );
+    unlink( e );
+    entry.value.reset();
+    free_.push_back( e );
+  }
+
+public:
+  explicit FlowTable( size_t max_flows ) : entries_( max_flows )
+  {
+    if ( max_flows == 0 || max_flows >= NONE ) {
+      throw std::runtime_error( "FlowTable needs room for at least one flow" );
+    }
+
+    size_t num_slots = 2;
+    while ( num_slots < 2 * max_flows ) {
+      num_slots *= 2;
+    }
+    slots_.resize( num_slots );
+    mask_ = num_slots - 1;
+
+    free_.reserve( max_flows );
+    for ( size_t e = max_flows; e-- > 0; ) {
+      free_.push_back( e );
+    }
+  }
+
+  // The flow's state, without counting as a use
+  Value* find( const Key& key )
+  {
+    const Slot& slot = slots_[probe( key, hash( key ) )];
+    return slot.entry == NONE ? nullptr : &*entries_[slot.entry].value;
+  }
+
+  // The flow's state, marked as used at `now`. New flows start as `make()`, evicting the least recently used flow
+  // if the table is full.
+  template<typename Make>
+  Value& find_or_insert( const Key& key, time_point now, Make&& make )
+  {
+    uint32_t h = hash( key );
+    size_t i = probe( key, h );
+
+    uint32_t e = slots_[i].entry;
+    if ( e != NONE ) {
+      unlink( e );
+    } else {
+      if ( free_.empty() ) {
+        remove( oldest_ );
+        counters_.evictions++;
+        i = probe( key, h, false );
+      }
+      e = free_.back();
+      free_.pop_back();
+      slots_[i] = { h, e };
+      entries_[e].key = key;
+      entries_[e].value.emplace( make() );
+      counters_.inserts++;
+    }
+
+    link_newest( e );
+    entries_[e].last_used = now;
+    return *entries_[e].value;
+  }
+
+  // Drop every flow not used since `cutoff`, calling `on_expire` with each one first. Only looks at the flows it
+  // drops, and the one after.
+  template<typename F>
+  size_t expire( time_point cutoff, F&& on_expire )
+  {
+    size_t expired = 0;
+    while ( oldest_ != NONE && entries_[oldest_].last_used < cutoff ) {
+      on_expire( entries_[oldest_].key, *entries_[oldest_].value );
+      remove( oldest_ );
+      counters_.expirations++;
+      expired++;
+    }
+    return expired;
+  }
+
+  size_t expire( time_point cutoff )
+  {
+    return expire( cutoff, []( const Key&, Value& ) {} );
+  }
+
+  // Call `f` with every flow, most recently used first
+  template<typename F>
+  void for_each( F&& f )
+  {
+    for ( uint32_t e = newest_; e != NONE; e = entries_[e].older ) {
+      f( entries_[e].key, *entries_[e].value );
+    }
+  }
+
+  size_t size() const { return entries_.size() - free_.size(); }
+  size_t capacity() const { return entries_.size(); }
+  const Counters& counters() const { return counters_; }
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Fixed-size log-linear histogram of unsigned values (e.g. latencies in ns). Each power of two is split into
+// 2^SUB_BUCKET_BITS buckets, so percentiles are within ~3% of the true value, and recording never allocates.
+class Histogram
+{
+private:
+  static constexpr unsigned SUB_BUCKET_BITS = 5;
+  static constexpr uint64_t SUB_BUCKETS = uint64_t { 1 } << SUB_BUCKET_BITS;
+  static constexpr size_t NUM_BUCKETS = ( 64 - SUB_BUCKET_BITS + 1 ) << SUB_BUCKET_BITS;
+
+  std::array<uint64_t, NUM_BUCKETS> counts_ {};
+  uint64_t count_ {};
+  uint64_t sum_ {};
+  uint64_t min_ { std::numeric_limits<uint64_t>::max() };
+  uint64_t max_ {};
+
+  // Values below SUB_BUCKETS get a bucket each; above, the bucket is picked by the exponent and the next
+  // SUB_BUCKET_BITS bits below the leading one
+  static size_t bucket( uint64_t value )
+  {
+    if ( value < SUB_BUCKETS ) {
+      return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll( value );
+    unsigned shift = exponent - SUB_BUCKET_BITS;
+    return ( ( shift + 1 ) << SUB_BUCKET_BITS ) + ( ( value >> shift ) & ( SUB_BUCKETS - 1 ) );
+  }
+
+  // Smallest value that falls into `bucket`
+  static uint64_t bucket_start( size_t bucket )
+  {
+    if ( bucket < SUB_BUCKETS ) {
+      return bucket;
+    }
+    unsigned shift = ( bucket >> SUB_BUCKET_BITS ) - 1;
+    return ( SUB_BUCKETS + ( bucket & ( SUB_BUCKETS - 1 ) ) ) << shift;
+  }
+
+public:
+  void record( uint64_t value )
+  {
+    counts_[bucket( value )]++;
+    count_++;
+    sum_ += value;
+    min_ = std::min( min_, value );
+    max_ = std::max( max_, value );
+  }
+
+  void merge( const Histogram& other )
+  {
+    for ( size_t i = 0; i < NUM_BUCKETS; i++ ) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min( min_, other.min_ );
+    max_ = std::max( max_, other.max_ );
+  }
+
+  void clear() { *this = Histogram(); }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? static_cast<double>( sum_ ) / count_ : 0; }
+
+  // Value at or below which `p` percent of recorded values fall, to the resolution of the buckets
+  uint64_t percentile( double p ) const
+  {
+    if ( count_ == 0 ) {
+      return 0;
+    }
+    if ( p >= 100 ) {
+      return max_;
+    }
+
+    uint64_t rank = std::max<uint64_t>( 1, static_cast<uint64_t>( p / 100 * count_ + 0.5 ) );
+    uint64_t seen = 0;
+    for ( size_t i = 0; i < NUM_BUCKETS; i++ ) {
+      seen += counts_[i];
+      if ( seen >= rank ) {
+        return std::clamp( bucket_start( i ), min_, max_ );
+      }
+    }
+    return max_;
+  }
+};
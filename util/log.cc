@@ -0,0 +1,278 @@
+#include "log.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "address.hh"
+#include "cli11.hh"
+
+std::atomic<LogLevel> Log::level_ { LogLevel::Info };
+std::atomic<uint32_t> Log::rate_limit_ { 100 };
+
+namespace {
+
+// Written by one thread, drained by the logger
+struct LogRing
+{
+  static constexpr size_t CAPACITY = 512;
+
+  std::array<LogRecord, CAPACITY> records;
+  std::atomic<uint64_t> head {}; // Next record to write
+  std::atomic<uint64_t> tail {}; // Next record to drain
+  std::atomic<uint64_t> dropped {};
+};
+
+// Owns every thread's ring, and the thread that drains them
+class Logger
+{
+  static constexpr auto DRAIN_PERIOD = std::chrono::milliseconds( 10 );
+
+  std::mutex mutex_ {};
+  std::condition_variable stop_cv_ {};
+  bool stopping_ {};
+  std::vector<std::unique_ptr<LogRing>> rings_ {};
+  std::thread drainer_ {};
+
+  // Only used by whoever holds `drain_mutex_`
+  std::mutex drain_mutex_ {};
+  std::vector<LogRecord> pending_ {};
+  std::string output_ {};
+
+  void run()
+  {
+    std::unique_lock lk( mutex_ );
+    while ( !stopping_ ) {
+      stop_cv_.wait_for( lk, DRAIN_PERIOD );
+      lk.unlock();
+      drain();
+      lk.lock();
+    }
+  }
+
+public:
+  // Stop the drainer, and write out what is left
+  void stop()
+  {
+    {
+      std::unique_lock lk( mutex_ );
+      stopping_ = true;
+    }
+    stop_cv_.notify_all();
+    if ( drainer_.joinable() ) {
+      drainer_.join();
+    }
+    drain();
+  }
+
+  LogRing* add_ring()
+  {
+    std::unique_lock lk( mutex_ );
+    rings_.push_back( std::make_unique<LogRing>() );
+    if ( !drainer_.joinable() && !stopping_ ) {
+      drainer_ = std::thread( [this] { run(); } );
+    }
+    return rings_.back().get();
+  }
+
+  // Write out every record in every ring, oldest first
+  void drain()
+  {
+    std::unique_lock drain_lk( drain_mutex_ );
+    uint64_t dropped = 0;
+    {
+      std::unique_lock lk( mutex_ );
+      for ( auto& ring : rings_ ) {
+        uint64_t tail = ring->tail.load( std::memory_order_relaxed );
+        uint64_t head = ring->head.load( std::memory_order_acquire );
+        for ( ; tail != head; tail++ ) {
+          pending_.push_back( ring->records[tail % LogRing::CAPACITY] );
+        }
+        ring->tail.store( tail, std::memory_order_release );
+        dropped += ring->dropped.exchange( 0, std::memory_order_relaxed );
+      }
+    }
+    if ( pending_.empty() && dropped == 0 ) {
+      return;
+    }
+
+    std::stable_sort( pending_.begin(), pending_.end(), []( const LogRecord& a, const LogRecord& b ) {
+      return a.timestamp_ns < b.timestamp_ns;
+    } );
+
+    static constexpr const char* LEVELS = "DIWE";
+    for ( const auto& record : pending_ ) {
+      char prefix[32];
+      int len = snprintf( prefix,
+                          sizeof( prefix ),
+                          "[%10.6f] %c ",
+                          static_cast<double>( record.timestamp_ns ) / 1e9,
+                          LEVELS[static_cast<size_t>( record.level )] );
+      output_.append( prefix, len );
+      output_.append( record.text, record.length );
+      output_.push_back( '\n' );
+    }
+    if ( dropped ) {
+      output_.append( "Log rings full, dropped " + std::to_string( dropped ) + " messages\n" );
+    }
+
+    fwrite( output_.data(), 1, output_.size(), stderr );
+    fflush( stderr );
+    pending_.clear();
+    output_.clear();
+  }
+};
+
+// Never destroyed, since threads still running at exit may log; stopped by an exit handler instead
+Logger& logger()
+{
+  static Logger* instance = [] {
+    auto* l = new Logger;
+    std::atexit( [] { logger().stop(); } );
+    return l;
+  }();
+  return *instance;
+}
+
+thread_local LogRing* this_thread_ring = nullptr;
+
+LogRing& ring()
+{
+  if ( !this_thread_ring ) {
+    this_thread_ring = logger().add_ring();
+  }
+  return *this_thread_ring;
+}
+
+const auto process_start = std::chrono::steady_clock::now();
+
+}
+
+void LogWriter::append_chars( std::string_view s )
+{
+  // Leave room for "..."
+  size_t room = LogRecord::MAX_TEXT - 3 - length_;
+  if ( s.size() > room ) {
+    s = s.substr( 0, room );
+    truncated_ = true;
+  }
+  memcpy( text_ + length_, s.data(), s.size() );
+  length_ += s.size();
+}
+
+void LogWriter::append( LogIPv4 ip )
+{
+  in_addr addr { htonl( ip.address ) };
+  char text[INET_ADDRSTRLEN];
+  append_chars( inet_ntop( AF_INET, &addr, text, sizeof( text ) ) );
+}
+
+void LogWriter::append( const Address& address )
+{
+  const sockaddr* raw = address.raw();
+  if ( raw->sa_family != AF_INET ) {
+    append_chars( address.to_string() );
+    return;
+  }
+
+  sockaddr_in ipv4_addr {};
+  memcpy( &ipv4_addr, raw, sizeof( ipv4_addr ) );
+  append( LogIPv4 { ntohl( ipv4_addr.sin_addr.s_addr ) } );
+  append( ':' );
+  append( ntohs( ipv4_addr.sin_port ) );
+}
+
+uint16_t LogWriter::finish()
+{
+  if ( truncated_ ) {
+    memcpy( text_ + length_, "...", 3 );
+    length_ += 3;
+  }
+  return length_;
+}
+
+bool LogRateLimit::allow( uint64_t now_ns, uint32_t& suppressed )
+{
+  uint32_t limit = Log::rate_limit();
+  if ( limit == 0 ) {
+    return true;
+  }
+
+  uint64_t second = now_ns / 1'000'000'000;
+  if ( second_.load( std::memory_order_relaxed ) != second ) {
+    second_.store( second, std::memory_order_relaxed );
+    in_second_.store( 0, std::memory_order_relaxed );
+  }
+  if ( in_second_.fetch_add( 1, std::memory_order_relaxed ) >= limit ) {
+    suppressed_.fetch_add( 1, std::memory_order_relaxed );
+    return false;
+  }
+  suppressed = suppressed_.exchange( 0, std::memory_order_relaxed );
+  return true;
+}
+
+LogRecord* Log::reserve()
+{
+  LogRing& r = ring();
+  uint64_t head = r.head.load( std::memory_order_relaxed );
+  if ( head - r.tail.load( std::memory_order_acquire ) == LogRing::CAPACITY ) {
+    r.dropped.fetch_add( 1, std::memory_order_relaxed );
+    return nullptr;
+  }
+  return &r.records[head % LogRing::CAPACITY];
+}
+
+void Log::commit()
+{
+  LogRing& r = ring();
+  r.head.store( r.head.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+}
+
+uint64_t Log::now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - process_start )
+    .count();
+}
+
+void Log::flush()
+{
+  logger().drain();
+}
+
+void add_log_options( CLI::App& app )
+{
+  static const std::map<std::string, LogLevel> levels {
+    { "debug", LogLevel::Debug }, { "info", LogLevel::Info }, { "warn", LogLevel::Warn },
+    { "error", LogLevel::Error }, { "off", LogLevel::Off },
+  };
+
+  app
+    .add_option_function<std::string>(
+      "--log-level",
+      []( const std::string& name ) { Log::set_level( levels.at( name ) ); },
+#ifdef SIDEKICK_DEBUG_LOG
+      "Least severe messages to log (debug logs each packet)" )
+#else
+      "Least severe messages to log (debug needs a SIDEKICK_DEBUG_LOG build)" )
+#endif
+    ->check( CLI::IsMember( levels ) )
+    ->default_str( "info" );
+  app
+    .add_option_function<uint32_t>(
+      "--log-rate",
+      []( uint32_t per_second ) { Log::set_rate_limit( per_second ); },
+      "Messages a second from any one place in the code, 0 for no limit" )
+    ->default_str( std::to_string( Log::rate_limit() ) );
+}
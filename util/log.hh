@@ -0,0 +1,191 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace CLI {
+class App;
+}
+
+class Address;
+
+// Logging that stays off the hot path: a message is formatted by the thread that logs it into a fixed-size record
+// in that thread's own ring, and a background thread drains every ring to stderr. Logging never blocks or takes a
+// lock; if a ring is full, the message is dropped and counted. Each call site also logs at most `rate_limit()`
+// messages a second, and says how many it held back when it next gets through.
+//
+// LOG_DEBUG is for per-packet detail. It compiles to nothing unless built with SIDEKICK_DEBUG_LOG, and even then
+// is off until --log-level debug.
+
+enum class LogLevel : uint8_t
+{
+  Debug,
+  Info,
+  Warn,
+  Error,
+  Off,
+};
+
+// An IPv4 address in host byte order, printed as a dotted quad
+struct LogIPv4
+{
+  uint32_t address;
+};
+
+// One message, as it sits in a ring
+struct LogRecord
+{
+  static constexpr size_t MAX_TEXT = 240;
+
+  uint64_t timestamp_ns;
+  uint16_t length;
+  LogLevel level;
+  char text[MAX_TEXT];
+};
+
+// Appends values to a record's text, cutting it short (with "...") if it runs out of room
+class LogWriter
+{
+  char* text_;
+  size_t length_ {};
+  bool truncated_ {};
+
+  void append_chars( std::string_view s );
+
+  template<typename T>
+  void append_number( T value )
+  {
+    std::array<char, 32> digits;
+    auto [end, ec] = std::to_chars( digits.data(), digits.data() + digits.size(), value );
+    append_chars( { digits.data(), static_cast<size_t>( end - digits.data() ) } );
+  }
+
+public:
+  explicit LogWriter( char* text ) : text_( text ) {}
+
+  void append( std::string_view s ) { append_chars( s ); }
+  void append( const char* s ) { append_chars( s ); }
+  void append( const std::string& s ) { append_chars( s ); }
+  void append( char c ) { append_chars( { &c, 1 } ); }
+  void append( bool b ) { append_chars( b ? "true" : "false" ); }
+  void append( LogIPv4 ip );
+
+  // Numerically, without the resolver (unlike Address::ip())
+  void append( const Address& address );
+
+  template<typename T>
+  requires std::integral<T> || std::floating_point<T>
+  void append( T value ) { append_number( value ); }
+
+  // Anything else that can be printed, e.g. power sums
+  template<typename T>
+  requires( !std::integral<T> && !std::floating_point<T> && !std::is_convertible_v<T, std::string_view> )
+  void append( const T& value )
+  {
+    std::ostringstream out;
+    out << value;
+    append_chars( out.str() );
+  }
+
+  // Ends the text, and returns its length
+  uint16_t finish();
+};
+
+// Limits one call site to `Log::rate_limit()` messages in each second. Threads sharing a call site may race at
+// the turn of a second, which only makes the limit approximate.
+class LogRateLimit
+{
+  std::atomic<uint64_t> second_ {};
+  std::atomic<uint32_t> in_second_ {};
+  std::atomic<uint32_t> suppressed_ {};
+
+public:
+  // Whether a message at `now_ns` may go out. If so, `suppressed` is how many were held back since the last one.
+  bool allow( uint64_t now_ns, uint32_t& suppressed );
+};
+
+class Log
+{
+  static std::atomic<LogLevel> level_;
+  static std::atomic<uint32_t> rate_limit_;
+
+  // The calling thread's next free record, or nullptr if its ring is full. commit() publishes it.
+  static LogRecord* reserve();
+  static void commit();
+
+public:
+  static bool enabled( LogLevel level ) { return level >= level_.load( std::memory_order_relaxed ); }
+  static void set_level( LogLevel level ) { level_.store( level, std::memory_order_relaxed ); }
+
+  // Messages a second from each call site, 0 for no limit
+  static uint32_t rate_limit() { return rate_limit_.load( std::memory_order_relaxed ); }
+  static void set_rate_limit( uint32_t per_second ) { rate_limit_.store( per_second, std::memory_order_relaxed ); }
+
+  static uint64_t now_ns();
+
+  template<typename... Args>
+  static void write( LogLevel level, LogRateLimit& limit, const Args&... args )
+  {
+    uint64_t now = now_ns();
+    uint32_t suppressed = 0;
+    if ( !limit.allow( now, suppressed ) ) {
+      return;
+    }
+    LogRecord* record = reserve();
+    if ( !record ) {
+      return;
+    }
+
+    record->timestamp_ns = now;
+    record->level = level;
+    LogWriter writer( record->text );
+    ( writer.append( args ), ... );
+    if ( suppressed ) {
+      writer.append( " (" );
+      writer.append( suppressed );
+      writer.append( " similar suppressed)" );
+    }
+    record->length = writer.finish();
+    commit();
+  }
+
+  // Write out everything logged so far, from the calling thread
+  static void flush();
+};
+
+// Register --log-level and --log-rate, which take effect as they are parsed
+void add_log_options( CLI::App& app );
+
+#define SIDEKICK_LOG( level, ... )                                                                                 \
+  do {                                                                                                             \
+    if ( Log::enabled( level ) ) {                                                                                 \
+      static LogRateLimit sidekick_log_limit_;                                                                     \
+      Log::write( level, sidekick_log_limit_, __VA_ARGS__ );                                                       \
+    }                                                                                                              \
+  } while ( 0 )
+
+#ifdef SIDEKICK_DEBUG_LOG
+#define LOG_DEBUG( ... ) SIDEKICK_LOG( LogLevel::Debug, __VA_ARGS__ )
+#else
+// Still type-checked, so debug logs can't rot, but never evaluated
+#define LOG_DEBUG( ... )                                                                                           \
+  do {                                                                                                             \
+    if ( false ) {                                                                                                 \
+      static LogRateLimit sidekick_log_limit_;                                                                     \
+      Log::write( LogLevel::Debug, sidekick_log_limit_, __VA_ARGS__ );                                             \
+    }                                                                                                              \
+  } while ( 0 )
+#endif
+
+#define LOG_INFO( ... ) SIDEKICK_LOG( LogLevel::Info, __VA_ARGS__ )
+#define LOG_WARN( ... ) SIDEKICK_LOG( LogLevel::Warn, __VA_ARGS__ )
+#define LOG_ERROR( ... ) SIDEKICK_LOG( LogLevel::Error, __VA_ARGS__ )
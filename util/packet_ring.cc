@@ -0,0 +1,117 @@
+#include "packet_ring.hh"
+#include "runtime.hh"
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// How long the kernel waits before handing over a block that isn't full, so quiet links still make progress
+static constexpr unsigned int BLOCK_TIMEOUT_MS = 1;
+
+// Upper bound on a single frame in the ring; V3 packs frames tightly, so this only limits the largest packet
+static constexpr unsigned int FRAME_SIZE = 1 << 11;
+
+void join_fanout_group( int fd, uint16_t group )
+{
+  // Reassemble fragments before hashing, so they land with the rest of their flow
+  int fanout = group | ( ( PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG ) << 16 );
+  if ( setsockopt( fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof( fanout ) ) < 0 ) {
+    throw std::runtime_error( "Failed to join packet fanout group " + std::to_string( group ) );
+  }
+}
+
+PacketRing::PacketRing( const std::string& interface,
+                        const sock_fprog& filter,
+                        size_t block_size,
+                        size_t block_count )
+  : block_size_( block_size ), block_count_( block_count )
+{
+  if ( ( socket_.fd = socket( AF_PACKET, SOCK_RAW, htons( ETH_P_ALL ) ) ) < 0 ) {
+    throw std::runtime_error( "Failed to open AF_PACKET socket" );
+  }
+
+  // Filter before binding, so nothing unfiltered makes it into the ring
+  if ( setsockopt( socket_.fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof( filter ) ) < 0 ) {
+    throw std::runtime_error( "Failed to attach packet filter" );
+  }
+
+  int version = TPACKET_V3;
+  if ( setsockopt( socket_.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof( version ) ) < 0 ) {
+    throw std::runtime_error( "TPACKET_V3 not supported" );
+  }
+
+  tpacket_req3 req {};
+  req.tp_block_size = block_size_;
+  req.tp_block_nr = block_count_;
+  req.tp_frame_size = FRAME_SIZE;
+  req.tp_frame_nr = ( block_size_ * block_count_ ) / FRAME_SIZE;
+  req.tp_retire_blk_tov = BLOCK_TIMEOUT_MS;
+  if ( setsockopt( socket_.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof( req ) ) < 0 ) {
+    throw std::runtime_error( "Failed to set up PACKET_RX_RING" );
+  }
+
+  void* ring = mmap( nullptr, block_size_ * block_count_, PROT_READ | PROT_WRITE, MAP_SHARED, socket_.fd, 0 );
+  if ( ring == MAP_FAILED ) {
+    throw std::runtime_error( "Failed to mmap packet ring" );
+  }
+  ring_.data = static_cast<uint8_t*>( ring );
+  ring_.length = block_size_ * block_count_;
+
+  sockaddr_ll addr {};
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons( ETH_P_ALL );
+  addr.sll_ifindex = if_nametoindex( interface.c_str() );
+  if ( addr.sll_ifindex == 0 ) {
+    throw std::runtime_error( "Unknown interface " + interface );
+  }
+  if ( bind( socket_.fd, reinterpret_cast<sockaddr*>( &addr ), sizeof( addr ) ) < 0 ) {
+    throw std::runtime_error( "Failed to bind AF_PACKET socket to " + interface );
+  }
+}
+
+const tpacket_block_desc* PacketRing::wait_for_block()
+{
+  auto block = reinterpret_cast<tpacket_block_desc*>( ring_.data + current_block_ * block_size_ );
+
+  // Only sleep once we've caught up with the kernel
+  auto ready = [&] {
+    return ( __atomic_load_n( &block->hdr.bh1.block_status, __ATOMIC_ACQUIRE ) & TP_STATUS_USER ) != 0;
+  };
+  spin_until( ready, spin_ );
+  while ( !ready() ) {
+    pollfd pfd { .fd = socket_.fd, .events = POLLIN | POLLERR, .revents = 0 };
+    int result = poll( &pfd, 1, poll_timeout_ms_ );
+    if ( result < 0 && errno != EINTR ) {
+      throw std::runtime_error( "poll() on packet ring failed" );
+    }
+    if ( result == 0 && !ready() ) {
+      return nullptr;
+    }
+  }
+  return block;
+}
+
+void PacketRing::release_block()
+{
+  auto block = reinterpret_cast<tpacket_block_desc*>( ring_.data + current_block_ * block_size_ );
+  __atomic_store_n( &block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE );
+  current_block_ = ( current_block_ + 1 ) % block_count_;
+}
+
+uint32_t PacketRing::drops()
+{
+  tpacket_stats_v3 stats {};
+  socklen_t len = sizeof( stats );
+  if ( getsockopt( socket_.fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len ) < 0 ) {
+    throw std::runtime_error( "Failed to read packet ring statistics" );
+  }
+  return stats.tp_drops;
+}
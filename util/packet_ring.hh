@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Have the kernel spread packets across every AF_PACKET socket that joins `group`, by a hash of their flow, so
+// each flow always lands on the same socket
+void join_fanout_group( int fd, uint16_t group );
+
+// AF_PACKET socket with a TPACKET_V3 memory-mapped receive ring. The kernel fills whole blocks of frames, and we
+// walk each one in place, so there is no syscall or copy per packet: only a poll() when we catch up.
+class PacketRing
+{
+private:
+  // Own the socket and the mapping on their own, so both are released if the constructor throws part way through
+  struct Socket
+  {
+    int fd { -1 };
+    ~Socket()
+    {
+      if ( fd >= 0 ) {
+        close( fd );
+      }
+    }
+  };
+  struct Mapping
+  {
+    uint8_t* data {};
+    size_t length {};
+    ~Mapping()
+    {
+      if ( data ) {
+        munmap( data, length );
+      }
+    }
+  };
+
+  // Declared in this order so the ring is unmapped before its socket is closed
+  Socket socket_ {};
+
+  // The ring is `block_count_` blocks of `block_size_` bytes, handed back and forth with the kernel in order
+  Mapping ring_ {};
+  size_t block_size_;
+  size_t block_count_;
+  size_t current_block_ {};
+
+  // How long to watch the next block before sleeping in poll(), and the longest to sleep (-1 for no limit)
+  std::chrono::steady_clock::duration spin_ {};
+  int poll_timeout_ms_ { -1 };
+
+  // The next block, or null if the poll timeout passed first
+  const tpacket_block_desc* wait_for_block();
+  void release_block();
+
+public:
+  static constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 18;
+  static constexpr size_t DEFAULT_BLOCK_COUNT = 16;
+
+  // Capture incoming packets on `interface` that pass `filter` (which also decides how much of each to keep)
+  PacketRing( const std::string& interface,
+              const sock_fprog& filter,
+              size_t block_size = DEFAULT_BLOCK_SIZE,
+              size_t block_count = DEFAULT_BLOCK_COUNT );
+
+  PacketRing( const PacketRing& ) = delete;
+  PacketRing& operator=( const PacketRing& ) = delete;
+
+  // Blocks until the kernel hands over a block, then calls `on_frame` with every frame in it (starting at the
+  // link-layer header) and its capture time in ns of CLOCK_REALTIME, and `on_block_end` once it is done with the
+  // block. `on_block_end` is also called, without any frames, whenever the poll timeout passes. Never returns.
+  template<typename FrameHandler, typename BlockEndHandler>
+  void run( FrameHandler&& on_frame, BlockEndHandler&& on_block_end )
+  {
+    while ( true ) {
+      const tpacket_block_desc* block = wait_for_block();
+      if ( !block ) {
+        on_block_end();
+        continue;
+      }
+      auto packet = reinterpret_cast<const uint8_t*>( block ) + block->hdr.bh1.offset_to_first_pkt;
+
+      for ( uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++ ) {
+        auto hdr = reinterpret_cast<const tpacket3_hdr*>( packet );
+        auto ll = reinterpret_cast<const sockaddr_ll*>( packet + TPACKET_ALIGN( sizeof( tpacket3_hdr ) ) );
+
+        // Like PCAP_D_IN: ignore what this host sends
+        if ( ll->sll_pkttype != PACKET_OUTGOING ) {
+          on_frame( std::string_view( reinterpret_cast<const char*>( packet ) + hdr->tp_mac, hdr->tp_snaplen ),
+                    static_cast<uint64_t>( hdr->tp_sec ) * 1'000'000'000 + hdr->tp_nsec );
+        }
+        packet += hdr->tp_next_offset;
+      }
+
+      on_block_end();
+      release_block();
+    }
+  }
+
+  void join_fanout_group( uint16_t group ) { ::join_fanout_group( socket_.fd, group ); }
+
+  void set_spin( std::chrono::steady_clock::duration spin ) { spin_ = spin; }
+  void set_poll_timeout( std::chrono::milliseconds timeout ) { poll_timeout_ms_ = timeout.count(); }
+
+  int fd() const { return socket_.fd; }
+
+  // Packets the kernel dropped because the ring was full, since the last call
+  uint32_t drops();
+};
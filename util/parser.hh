@@ -2,6 +2,7 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <concepts>
 #include <cstdint>
 #include <cstring>
@@ -220,6 +221,31 @@ public:
   }
 };
 
+// Serializes integers straight into an array of at most N bytes, e.g. on the stack, for messages with a known
+// bound that are sent often
+template<size_t N>
+class FixedSerializer
+{
+  std::array<char, N> buffer_ {};
+  size_t size_ {};
+
+public:
+  template<std::unsigned_integral T>
+  void integer( const T val )
+  {
+    constexpr size_t len = sizeof( T );
+    if ( size_ + len > N ) {
+      throw std::runtime_error( "FixedSerializer ran out of space" );
+    }
+
+    for ( size_t i = 0; i < len; ++i ) {
+      buffer_[size_++] = static_cast<char>( static_cast<uint8_t>( val >> ( ( len - i - 1 ) * 8 ) ) );
+    }
+  }
+
+  std::string_view output() const { return { buffer_.data(), size_ }; }
+};
+
 // Helper to serialize any object (without constructing a Serializer of the caller's own)
 template<class T>
 std::vector<std::string> serialize( const T& obj )
@@ -255,7 +281,7 @@ T str_to_uint( std::string_view val )
   T out = 0;
   for ( size_t i = 0; i < sizeof( out ); i++ ) {
     out <<= 8;
-    out |= static_cast<T>( val[i] );
+    out |= static_cast<uint8_t>( val[i] );
   }
   return be32toh( out );
 }
@@ -1,33 +1,335 @@
 #include "quack.hh"
 
-void PowerSums::add( const ModInt n )
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Adds the first `sums.size()` powers of every id into `sums`
+using LadderKernel = void ( * )( std::span<const uint32_t> ids, std::span<QuackInt> sums );
+
+// Marks which of `xs` are roots of the polynomial with `coeffs` (ordered from highest degree to lowest)
+using RootKernel = void ( * )( std::span<const QuackInt> coeffs, std::span<const uint32_t> xs, std::span<bool> is_root );
+
+void add_ladders_scalar( std::span<const uint32_t> ids, std::span<QuackInt> sums )
+{
+  for ( const uint32_t id : ids ) {
+    QuackInt n = id;
+    QuackInt tmp = n;
+    for ( auto& sum : sums ) {
+      sum += tmp;
+      tmp *= n;
+    }
+  }
+}
+
+#if defined( __x86_64__ )
+// QuackInt::reduce() on four 64-bit lanes at once
+__attribute__( ( target( "avx2" ) ) ) inline __m256i reduce_x4( __m256i n )
+{
+  const __m256i low_bits = _mm256_set1_epi64x( 0xffffffff );
+  const __m256i fold = _mm256_set1_epi64x( QuackInt::FOLD );
+  n = _mm256_add_epi64( _mm256_mul_epu32( _mm256_srli_epi64( n, 32 ), fold ), _mm256_and_si256( n, low_bits ) );
+  n = _mm256_add_epi64( _mm256_mul_epu32( _mm256_srli_epi64( n, 32 ), fold ), _mm256_and_si256( n, low_bits ) );
+
+  // n < 2P < 2^63 here, so a signed comparison is enough to find the lanes that need P subtracted
+  const __m256i too_big = _mm256_cmpgt_epi64( n, _mm256_set1_epi64x( QuackInt::MODULUS - 1 ) );
+  return _mm256_sub_epi64( n, _mm256_and_si256( too_big, _mm256_set1_epi64x( QuackInt::MODULUS ) ) );
+}
+
+// Four power ladders per vector. Rather than walking one ladder at a time (a serial chain of dependent
+// multiplies), step every ladder in a chunk up by one power per pass, so the multiplies within a pass are
+// independent of each other. Chunks are small enough to keep their ladders on the stack.
+__attribute__( ( target( "avx2" ) ) ) void add_ladders_avx2( std::span<const uint32_t> ids, std::span<QuackInt> sums )
+{
+  static constexpr size_t CHUNK_VECTORS = 16;
+  alignas( 32 ) uint64_t bases[CHUNK_VECTORS * 4];
+  alignas( 32 ) uint64_t powers[CHUNK_VECTORS * 4];
+
+  size_t done = 0;
+  while ( ids.size() - done >= 4 ) {
+    const size_t num_vectors = std::min( ( ids.size() - done ) / 4, CHUNK_VECTORS );
+    for ( size_t v = 0; v < num_vectors; v++ ) {
+      const __m128i packed = _mm_loadu_si128( reinterpret_cast<const __m128i*>( ids.data() + done + v * 4 ) );
+      const __m256i base = reduce_x4( _mm256_cvtepu32_epi64( packed ) );
+      _mm256_store_si256( reinterpret_cast<__m256i*>( bases + v * 4 ), base );
+      _mm256_store_si256( reinterpret_cast<__m256i*>( powers + v * 4 ), base );
+    }
+
+    for ( size_t i = 0; i < sums.size(); i++ ) {
+      // Lanes stay unreduced while summing: each addend is below 2^32, so this holds 2^32 ids per lane
+      __m256i acc = _mm256_setzero_si256();
+      for ( size_t v = 0; v < num_vectors; v++ ) {
+        __m256i* power = reinterpret_cast<__m256i*>( powers + v * 4 );
+        const __m256i base = _mm256_load_si256( reinterpret_cast<const __m256i*>( bases + v * 4 ) );
+        const __m256i current = _mm256_load_si256( power );
+        acc = _mm256_add_epi64( acc, current );
+        _mm256_store_si256( power, reduce_x4( _mm256_mul_epu32( current, base ) ) );
+      }
+
+      alignas( 32 ) uint64_t lanes[4];
+      _mm256_store_si256( reinterpret_cast<__m256i*>( lanes ), acc );
+      for ( const uint64_t lane : lanes ) {
+        sums[i] += lane;
+      }
+    }
+    done += num_vectors * 4;
+  }
+
+  add_ladders_scalar( ids.subspan( done ), sums );
+}
+#endif
+
+void find_roots_scalar( std::span<const QuackInt> coeffs, std::span<const uint32_t> xs, std::span<bool> is_root )
+{
+  for ( size_t i = 0; i < xs.size(); i++ ) {
+    QuackInt x = xs[i];
+    QuackInt y = 0;
+    for ( auto coeff : coeffs ) {
+      y = y * x + coeff;
+    }
+    is_root[i] = y == 0;
+  }
+}
+
+#if defined( __x86_64__ )
+__attribute__( ( target( "avx2" ) ) ) inline __m256i add_x4( __m256i a, __m256i b )
+{
+  const __m256i sum = _mm256_add_epi64( a, b );
+  const __m256i too_big = _mm256_cmpgt_epi64( sum, _mm256_set1_epi64x( QuackInt::MODULUS - 1 ) );
+  return _mm256_sub_epi64( sum, _mm256_and_si256( too_big, _mm256_set1_epi64x( QuackInt::MODULUS ) ) );
+}
+
+__attribute__( ( target( "avx2" ) ) ) inline __m256i load_points_x4( const uint32_t* xs )
+{
+  return reduce_x4( _mm256_cvtepu32_epi64( _mm_loadu_si128( reinterpret_cast<const __m128i*>( xs ) ) ) );
+}
+
+__attribute__( ( target( "avx2" ) ) ) inline void store_roots_x4( __m256i y, bool* is_root )
+{
+  const int mask = _mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpeq_epi64( y, _mm256_setzero_si256() ) ) );
+  for ( int lane = 0; lane < 4; lane++ ) {
+    is_root[lane] = mask & ( 1 << lane );
+  }
+}
+
+// Horner's method on eight points per iteration: two independent vectors keep the multiplier busy while
+// the other one's reduction is still in flight
+__attribute__( ( target( "avx2" ) ) ) void find_roots_avx2( std::span<const QuackInt> coeffs,
+                                                            std::span<const uint32_t> xs,
+                                                            std::span<bool> is_root )
+{
+  size_t i = 0;
+  for ( ; i + 8 <= xs.size(); i += 8 ) {
+    const __m256i x_lo = load_points_x4( xs.data() + i );
+    const __m256i x_hi = load_points_x4( xs.data() + i + 4 );
+    __m256i y_lo = _mm256_setzero_si256();
+    __m256i y_hi = _mm256_setzero_si256();
+    for ( auto coeff : coeffs ) {
+      const __m256i c = _mm256_set1_epi64x( coeff.value() );
+      y_lo = add_x4( reduce_x4( _mm256_mul_epu32( y_lo, x_lo ) ), c );
+      y_hi = add_x4( reduce_x4( _mm256_mul_epu32( y_hi, x_hi ) ), c );
+    }
+    store_roots_x4( y_lo, is_root.data() + i );
+    store_roots_x4( y_hi, is_root.data() + i + 4 );
+  }
+
+  find_roots_scalar( coeffs, xs.subspan( i ), is_root.subspan( i ) );
+}
+#endif
+
+LadderKernel select_ladder_kernel()
+{
+#if defined( __x86_64__ )
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    return add_ladders_avx2;
+  }
+#endif
+  return add_ladders_scalar;
+}
+
+RootKernel select_root_kernel()
+{
+#if defined( __x86_64__ )
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    return find_roots_avx2;
+  }
+#endif
+  return find_roots_scalar;
+}
+
+} // namespace
+
+DuplicateFilter::DuplicateFilter( size_t horizon ) : horizon_( horizon )
+{
+  if ( horizon == 0 || horizon > MAX_HORIZON ) {
+    throw std::runtime_error( "DuplicateFilter horizon must be between 1 and " + std::to_string( MAX_HORIZON ) );
+  }
+}
+
+size_t DuplicateFilter::find( uint32_t id ) const
+{
+  const size_t mask = table_.size() - 1;
+  for ( size_t slot = home( id ); table_[slot] != EMPTY; slot = ( slot + 1 ) & mask ) {
+    if ( ring_[table_[slot]] == id ) {
+      return slot;
+    }
+  }
+  return NOT_FOUND;
+}
+
+// Backward-shift deletion: pull later entries of the probe run into the hole, so lookups never need tombstones
+void DuplicateFilter::erase_slot( size_t slot )
+{
+  const size_t mask = table_.size() - 1;
+  size_t hole = slot;
+  for ( size_t next = ( hole + 1 ) & mask; table_[next] != EMPTY; next = ( next + 1 ) & mask ) {
+    // The entry at `next` may move into the hole only if its home slot isn't cyclically within (hole, next]
+    const size_t next_home = home( ring_[table_[next]] );
+    const bool stays = hole <= next ? ( hole < next_home && next_home <= next )
+                                    : ( hole < next_home || next_home <= next );
+    if ( !stays ) {
+      table_[hole] = table_[next];
+      hole = next;
+    }
+  }
+  table_[hole] = EMPTY;
+}
+
+bool DuplicateFilter::insert( uint32_t id )
 {
-  if ( items_.contains( n ) ) {
+  if ( table_.empty() ) {
+    // At least twice the horizon, so the table is never more than half full
+    size_t table_size = 2;
+    hash_shift_ = 31;
+    while ( table_size < 2 * horizon_ ) {
+      table_size <<= 1;
+      hash_shift_--;
+    }
+    ring_.resize( horizon_ );
+    table_.assign( table_size, EMPTY );
+  } else if ( find( id ) != NOT_FOUND ) {
+    return false;
+  }
+
+  const uint16_t position = next_++ % horizon_;
+
+  // Forget the id that currently occupies this ring position, unless it was erased (and perhaps re-inserted
+  // elsewhere) in the meantime
+  if ( next_ > horizon_ ) {
+    const size_t oldest = find( ring_[position] );
+    if ( oldest != NOT_FOUND && table_[oldest] == position ) {
+      erase_slot( oldest );
+    }
+  }
+
+  ring_[position] = id;
+  const size_t mask = table_.size() - 1;
+  size_t slot = home( id );
+  while ( table_[slot] != EMPTY ) {
+    slot = ( slot + 1 ) & mask;
+  }
+  table_[slot] = position;
+  return true;
+}
+
+bool DuplicateFilter::erase( uint32_t id )
+{
+  const size_t slot = table_.empty() ? NOT_FOUND : find( id );
+  if ( slot == NOT_FOUND ) {
+    return false;
+  }
+  erase_slot( slot );
+  return true;
+}
+
+void DuplicateFilter::clear()
+{
+  std::fill( table_.begin(), table_.end(), EMPTY );
+  next_ = 0;
+}
+
+void PowerSums::add( const QuackInt n )
+{
+  if ( !items_.insert( n.value() ) ) {
     return;
   }
-  items_.emplace( n );
+  count_++;
 
-  ModInt tmp = n;
+  QuackInt tmp = n;
   for ( size_t i = 0; i < threshold_; i++ ) {
     sums_[i] += tmp;
     tmp *= n;
   }
 }
 
-void PowerSums::remove( const ModInt n )
+void PowerSums::clear()
+{
+  std::fill( sums_.begin(), sums_.end(), 0 );
+  items_.clear();
+  count_ = 0;
+}
+
+void PowerSums::add_batch( std::span<const uint32_t> ids )
+{
+  static const LadderKernel add_ladders = select_ladder_kernel();
+
+  // Drop ids that were already added, including repeats within this batch, gathering the rest on the stack a
+  // chunk at a time
+  static constexpr size_t CHUNK = 64;
+  uint32_t fresh_ids[CHUNK];
+  size_t num_fresh = 0;
+  for ( const uint32_t id : ids ) {
+    if ( items_.insert( QuackInt( id ).value() ) ) {
+      fresh_ids[num_fresh++] = id;
+    }
+    if ( num_fresh == CHUNK ) {
+      add_ladders( std::span<const uint32_t>( fresh_ids, CHUNK ), sums_ );
+      count_ += num_fresh;
+      num_fresh = 0;
+    }
+  }
+
+  add_ladders( std::span<const uint32_t>( fresh_ids, num_fresh ), sums_ );
+  count_ += num_fresh;
+}
+
+void PowerSums::remove( const QuackInt n )
 {
-  if ( !items_.contains( n ) ) {
+  if ( !items_.erase( n.value() ) ) {
     return;
   }
-  items_.erase( n );
+  count_--;
 
-  ModInt tmp = n;
+  QuackInt tmp = n;
   for ( size_t i = 0; i < threshold_; i++ ) {
     sums_[i] -= tmp;
     tmp *= n;
   }
 }
 
+void PowerSums::overwrite( const PowerSums& other, uint32_t count )
+{
+  if ( other.size() > threshold_ ) {
+    throw std::runtime_error( "PowerSums::overwrite() called with more power sums than it has" );
+  }
+
+  std::copy( other.sums_.begin(), other.sums_.end(), sums_.begin() );
+  count_ = count;
+}
+
+void PowerSums::forget( std::span<const uint32_t> ids )
+{
+  for ( const uint32_t id : ids ) {
+    items_.erase( QuackInt( id ).value() );
+  }
+}
+
 PowerSums PowerSums::difference( const PowerSums& other )
 {
   PowerSums diff( threshold_ );
@@ -37,6 +339,13 @@ PowerSums PowerSums::difference( const PowerSums& other )
   return diff;
 }
 
+void PowerSums::difference( const PowerSums& other, PowerSums& out ) const
+{
+  for ( size_t i = 0; i < std::min( threshold_, other.size() ); i++ ) {
+    out.sums_[i] = sums_[i] - other.sums_[i];
+  }
+}
+
 // Newton's identities
 //
 // Coefficients of the polynomial with roots x1,...,xn can
@@ -65,13 +374,44 @@ Polynomial::Polynomial( const PowerSums& sums )
   }
 }
 
+// Same as the constructor, but reuses the coefficient storage and multiplies by precomputed inverses instead
+// of running the extended Euclidean algorithm for every coefficient
+void Polynomial::assign( const PowerSums& sums, size_t degree, std::span<const QuackInt> inverses )
+{
+  if ( degree > sums.size() || inverses.size() <= degree ) {
+    throw std::runtime_error( "Polynomial::assign() needs a power sum and an inverse for every coefficient" );
+  }
+
+  coeffs_.assign( degree + 1, 0 );
+  coeffs_[0] = 1; // x^n
+
+  for ( size_t i = 1; i < coeffs_.size(); i++ ) {
+    for ( size_t j = 1; j < i; j++ ) {
+      coeffs_[i] -= coeffs_[i - j] * sums[j - 1];
+    }
+
+    coeffs_[i] -= sums[i - 1];
+    coeffs_[i] *= inverses[i];
+  }
+}
+
 // Evaluates a polynomial at `x` via Horner's method. `coeffs` should be ordered
 // from highest degree to lowest.
-ModInt Polynomial::eval( ModInt x )
+QuackInt Polynomial::eval( QuackInt x )
 {
-  ModInt y = 0;
+  QuackInt y = 0;
   for ( auto coeff : coeffs_ ) {
     y = y * x + coeff;
   }
   return y;
-}
\ No newline at end of file
+}
+
+void Polynomial::eval_many( std::span<const uint32_t> xs, std::span<bool> is_root ) const
+{
+  static const RootKernel find_roots = select_root_kernel();
+
+  if ( is_root.size() < xs.size() ) {
+    throw std::runtime_error( "Polynomial::eval_many() needs one output per point" );
+  }
+  find_roots( coeffs_, xs, is_root );
+}
@@ -4,96 +4,202 @@
 #include <cstdint>
 #include <iostream>
 #include <memory>
-#include <set>
+#include <span>
 #include <vector>
 
-// 32-bit Modular Integer
+static constexpr uint64_t QUACK_MODULUS = 4294967291; // Largest prime less than 2^32 - 1
+
+// 32-bit modular integer over a compile-time prime `P` just below 2^32
+//
+// Since 2^32 = C (mod P) where C = 2^32 - P is small, a 64-bit value `hi * 2^32 + lo` is congruent to
+// `hi * C + lo`. Folding twice brings any 64-bit value below 2P, so a single conditional subtraction
+// finishes the reduction without ever issuing a division.
+template<uint64_t P>
 class ModInt
 {
-  static constexpr uint64_t QUACK_MODULUS = 4294967291; // Largest prime less than 2^32 - 1
+public:
+  static constexpr uint64_t MODULUS = P;
+  static constexpr uint64_t FOLD = ( uint64_t { 1 } << 32 ) - P; // 2^32 mod P
+
+  static_assert( P < ( uint64_t { 1 } << 32 ) && FOLD < ( 1 << 15 ), "ModInt<P> needs P = 2^32 - C for a small C" );
 
 private:
-  uint64_t value_;
-  uint64_t prime_;
+  uint32_t value_;
+
+  // Maps [0, 2P) onto [0, P); compiles to a cmov rather than a branch
+  static constexpr uint32_t conditional_subtract( uint64_t n ) { return n >= P ? n - P : n; }
 
 public:
-  ModInt() : value_( 0 ), prime_( QUACK_MODULUS ) {}
-  ModInt( uint64_t n ) : value_( n % QUACK_MODULUS ), prime_( QUACK_MODULUS ) {}
-  ModInt( uint64_t n, uint64_t prime ) : value_( n % prime ), prime_( prime ) {} // For testing
+  // Reduce an arbitrary 64-bit value modulo P
+  static constexpr uint32_t reduce( uint64_t n )
+  {
+    n = ( n >> 32 ) * FOLD + static_cast<uint32_t>( n ); // n < (C + 1) * 2^32
+    n = ( n >> 32 ) * FOLD + static_cast<uint32_t>( n ); // n < C * (C + 1) + 2^32 < 2P
+    return conditional_subtract( n );
+  }
 
-  uint32_t value() const { return value_; };
+  constexpr ModInt() : value_( 0 ) {}
+  constexpr ModInt( uint64_t n ) : value_( reduce( n ) ) {}
 
-  ModInt operator+( const ModInt& rhs ) { return ModInt( value_, prime_ ) += rhs; }
-  ModInt& operator+=( const ModInt& rhs )
+  constexpr uint32_t value() const { return value_; };
+
+  constexpr ModInt operator+( const ModInt& rhs ) const { return ModInt( *this ) += rhs; }
+  constexpr ModInt& operator+=( const ModInt& rhs )
   {
-    assert( prime_ == rhs.prime_ );
-    value_ = ( value_ + rhs.value_ ) % prime_;
+    value_ = conditional_subtract( uint64_t { value_ } + rhs.value_ );
     return *this;
   }
 
-  ModInt operator-( const ModInt& rhs ) { return ModInt( value_, prime_ ) -= rhs; }
-  ModInt& operator-=( const ModInt& rhs )
+  constexpr ModInt operator-( const ModInt& rhs ) const { return ModInt( *this ) -= rhs; }
+  constexpr ModInt& operator-=( const ModInt& rhs )
   {
-    assert( prime_ == rhs.prime_ );
-    if ( value_ < rhs.value_ )
-      value_ += prime_;
-    value_ = value_ - rhs.value_;
+    // Wraps modulo 2^32 when borrowing, adding P back lands the result in [0, P)
+    value_ = value_ - rhs.value_ + ( value_ < rhs.value_ ? P : 0 );
     return *this;
   }
 
-  ModInt operator*( const ModInt& rhs ) { return ModInt( value_, prime_ ) *= rhs; }
-  ModInt& operator*=( const ModInt& rhs )
+  constexpr ModInt operator*( const ModInt& rhs ) const { return ModInt( *this ) *= rhs; }
+  constexpr ModInt& operator*=( const ModInt& rhs )
   {
-    assert( prime_ == rhs.prime_ );
-    value_ = ( value_ * rhs.value_ ) % prime_;
+    value_ = reduce( uint64_t { value_ } * rhs.value_ );
+    return *this;
+  }
+
+  constexpr ModInt operator%( const ModInt& rhs ) const { return ModInt( *this ) %= rhs; }
+  constexpr ModInt& operator%=( const ModInt& rhs )
+  {
+    value_ = value_ % rhs.value_;
     return *this;
   }
 
-  ModInt operator%( const ModInt& rhs ) { return ModInt( value_, prime_ ) %= rhs; }
-  ModInt& operator%=( const ModInt& rhs )
+  constexpr ModInt operator/( const ModInt& rhs ) const { return ModInt( *this ) /= rhs; }
+  constexpr ModInt& operator/=( const ModInt& rhs )
+  {
+    *this *= rhs.inverse();
+    return *this;
+  }
+
+  constexpr ModInt& operator++()
+  {
+    value_ = conditional_subtract( uint64_t { value_ } + 1 );
+    return *this;
+  }
+
+  constexpr ModInt& operator--()
+  {
+    value_ = value_ == 0 ? P - 1 : value_ - 1;
+    return *this;
+  }
+
+  constexpr bool operator==( const ModInt& rhs ) const { return value_ == rhs.value_; }
+  constexpr bool operator!=( const ModInt& rhs ) const { return value_ != rhs.value_; }
+
+  // Fermat or Euclid will help us calculate the inverse of x.
+  //
+  // Euclid's theorem says that `ax + by = gcd(a, b) = 1` since `b` is prime.
+  // So `x` will be the inverse of `a`.
+  constexpr ModInt inverse() const
+  {
+    int64_t a = value_;
+    int64_t b = P;
+    int64_t x = 1;
+    int64_t y = 0;
+    int64_t quotient;
+    int64_t temp;
+
+    while ( a > 1 ) {
+      quotient = a / b;
+
+      temp = b;
+      b = a % b;
+      a = temp;
+
+      temp = y;
+      y = x - quotient * y;
+      x = temp;
+    }
+
+    if ( x < 0 ) {
+      x += P;
+    }
+
+    return ModInt( x );
+  }
+
+  friend std::ostream& operator<<( std::ostream& stream, const ModInt& obj )
+  {
+    stream << obj.value_;
+    return stream;
+  }
+
+  friend constexpr bool operator<( const ModInt& l, const ModInt& r ) { return l.value_ < r.value_; };
+};
+
+// The 4-byte field element used by power sums and on the wire
+using QuackInt = ModInt<QUACK_MODULUS>;
+
+// Modular integer over a prime chosen at runtime. Every operation pays a 64-bit division, so this is only
+// meant for testing the quACK math with small primes; use `QuackInt` everywhere else.
+class RuntimeModInt
+{
+private:
+  uint64_t value_;
+  uint64_t prime_;
+
+public:
+  RuntimeModInt() : value_( 0 ), prime_( QUACK_MODULUS ) {}
+  RuntimeModInt( uint64_t n, uint64_t prime ) : value_( n % prime ), prime_( prime ) {}
+
+  uint32_t value() const { return value_; };
+
+  RuntimeModInt operator+( const RuntimeModInt& rhs ) { return RuntimeModInt( value_, prime_ ) += rhs; }
+  RuntimeModInt& operator+=( const RuntimeModInt& rhs )
   {
     assert( prime_ == rhs.prime_ );
-    value_ = ( value_ % rhs.value_ ) % prime_;
+    value_ = ( value_ + rhs.value_ ) % prime_;
     return *this;
   }
 
-  ModInt operator/( const ModInt& rhs ) { return ModInt( value_, prime_ ) /= rhs; }
-  ModInt& operator/=( const ModInt& rhs )
+  RuntimeModInt operator-( const RuntimeModInt& rhs ) { return RuntimeModInt( value_, prime_ ) -= rhs; }
+  RuntimeModInt& operator-=( const RuntimeModInt& rhs )
   {
     assert( prime_ == rhs.prime_ );
-    *this *= rhs.inverse();
+    if ( value_ < rhs.value_ )
+      value_ += prime_;
+    value_ = value_ - rhs.value_;
     return *this;
   }
 
-  ModInt& operator++()
+  RuntimeModInt operator*( const RuntimeModInt& rhs ) { return RuntimeModInt( value_, prime_ ) *= rhs; }
+  RuntimeModInt& operator*=( const RuntimeModInt& rhs )
   {
-    value_ = ( value_ + 1 ) % prime_;
+    assert( prime_ == rhs.prime_ );
+    value_ = ( value_ * rhs.value_ ) % prime_;
     return *this;
   }
 
-  ModInt& operator--()
+  RuntimeModInt operator/( const RuntimeModInt& rhs ) { return RuntimeModInt( value_, prime_ ) /= rhs; }
+  RuntimeModInt& operator/=( const RuntimeModInt& rhs )
   {
-    value_ = ( value_ - 1 ) % prime_;
+    assert( prime_ == rhs.prime_ );
+    *this *= rhs.inverse();
     return *this;
   }
 
-  bool operator==( const ModInt& rhs )
+  bool operator==( const RuntimeModInt& rhs )
   {
     assert( prime_ == rhs.prime_ );
     return value_ == rhs.value_;
   }
 
-  bool operator!=( const ModInt& rhs )
+  bool operator!=( const RuntimeModInt& rhs )
   {
     assert( prime_ == rhs.prime_ );
     return value_ != rhs.value_;
   }
 
-  // Fermat or Euclid will help us calculate the inverse of x.
-  //
-  // Euclid's theorem says that `ax + by = gcd(a, b) = 1` since `b` is prime.
-  // So `x` will be the inverse of `a`.
-  ModInt inverse() const
+  // Same extended Euclid as `ModInt::inverse()`, against the runtime prime
+  RuntimeModInt inverse() const
   {
     int64_t a = value_;
     int64_t b = prime_;
@@ -118,40 +224,98 @@ public:
       x += prime_;
     }
 
-    return ModInt( x, prime_ );
+    return RuntimeModInt( x, prime_ );
   }
 
-  friend std::ostream& operator<<( std::ostream& stream, const ModInt& obj )
+  friend std::ostream& operator<<( std::ostream& stream, const RuntimeModInt& obj )
   {
     stream << obj.value_;
     return stream;
   }
+};
 
-  friend bool operator<( const ModInt& l, const ModInt& r ) { return l.value_ < r.value_; };
+// Remembers the `horizon` most recently inserted ids in constant memory, to suppress duplicates. Ids sit in a
+// ring in insertion order, and an open-addressed table of ring positions (linear probing, backward-shift
+// deletion) answers lookups. Once the ring is full, each insertion forgets the oldest id.
+//
+// Storage is only allocated on the first insertion, so power sums that never add ids stay small.
+class DuplicateFilter
+{
+public:
+  static constexpr size_t DEFAULT_HORIZON = 1024;
+  static constexpr size_t MAX_HORIZON = 1 << 15;
+
+private:
+  static constexpr uint16_t EMPTY = UINT16_MAX;
+  static constexpr size_t NOT_FOUND = SIZE_MAX;
+
+  size_t horizon_;
+  std::vector<uint32_t> ring_ {};
+  std::vector<uint16_t> table_ {}; // Ring positions, or EMPTY
+  uint32_t hash_shift_ {};
+  size_t next_ {}; // Total insertions; the next id goes to ring position next_ % horizon_
+
+  size_t home( uint32_t id ) const { return static_cast<uint32_t>( id * 0x9E3779B9u ) >> hash_shift_; }
+  size_t find( uint32_t id ) const;
+  void erase_slot( size_t slot );
+
+public:
+  explicit DuplicateFilter( size_t horizon = DEFAULT_HORIZON );
+
+  // Returns false (and changes nothing) if `id` is already remembered
+  bool insert( uint32_t id );
+  // Returns false if `id` wasn't remembered
+  bool erase( uint32_t id );
+  bool contains( uint32_t id ) const { return !table_.empty() && find( id ) != NOT_FOUND; }
+  void clear();
+
+  size_t horizon() const { return horizon_; }
 };
 
 class PowerSums
 {
 private:
-  std::vector<ModInt> sums_ {};
-  std::set<ModInt> items_ {};
+  std::vector<QuackInt> sums_ {};
+  DuplicateFilter items_;
   size_t threshold_;
+  uint32_t count_ {}; // Number of ids currently folded into the sums
 
 public:
-  PowerSums( size_t threshold ) : threshold_( threshold ) { sums_.resize( threshold ); }
+  // Both ends of a flow must use the same duplicate horizon, or they will disagree about which re-sent ids
+  // are counted twice
+  PowerSums( size_t threshold, size_t horizon = DuplicateFilter::DEFAULT_HORIZON )
+    : items_( horizon ), threshold_( threshold )
+  {
+    sums_.resize( threshold );
+  }
   // Directly construct the power sums
-  PowerSums( std::vector<ModInt>& sums )
+  PowerSums( std::vector<QuackInt>& sums )
   {
     sums_ = std::move( sums );
     threshold_ = sums_.size();
   };
 
   size_t size() const { return threshold_; }
-  void add( const ModInt n );
-  void remove( const ModInt n );
+  uint32_t count() const { return count_; }
+  void add( const QuackInt n );
+  // Forget every id, returning to the all-zero sums
+  void clear();
+  // Same as calling `add()` on every id, but computes the power ladders of several ids at once
+  void add_batch( std::span<const uint32_t> ids );
+  void remove( const QuackInt n );
+  // Take over another party's sums and id count, keeping our own duplicate filter. Used to resynchronize when
+  // the difference can no longer be decoded. If `other` has fewer sums, the rest stay as they were until a quACK
+  // that carries them resynchronizes them too.
+  void overwrite( const PowerSums& other, uint32_t count );
+  // Forget that `ids` were added, leaving the sums alone, so they count again if added later. After overwrite(),
+  // for ids the other party may never have seen.
+  void forget( std::span<const uint32_t> ids );
   PowerSums difference( const PowerSums& other );
+  // Writes `this - other` into `out`, which must have the same threshold as `this`, without allocating. `other` may
+  // have fewer sums (e.g. a quACK with a lower threshold), and only that many are written.
+  void difference( const PowerSums& other, PowerSums& out ) const;
 
-  const ModInt& operator[]( int idx ) const { return sums_[idx]; }
+  const QuackInt& operator[]( int idx ) const { return sums_[idx]; }
   friend std::ostream& operator<<( std::ostream& stream, const PowerSums& obj )
   {
     for ( auto sum : obj.sums_ ) {
@@ -164,11 +328,19 @@ public:
 class Polynomial
 {
 private:
-  std::vector<ModInt> coeffs_ {};
+  std::vector<QuackInt> coeffs_ {};
 
 public:
+  // All-zero polynomial of the given degree, to be filled in later with `assign()`
+  explicit Polynomial( size_t degree ) { coeffs_.resize( degree + 1 ); }
   Polynomial( const PowerSums& sums );
-  ModInt eval( ModInt x );
+
+  // Rebuild in place as the degree `degree` polynomial whose roots have the first `degree` power sums in `sums`,
+  // where `inverses[i]` holds 1/i for every i up to `degree`
+  void assign( const PowerSums& sums, size_t degree, std::span<const QuackInt> inverses );
+  QuackInt eval( QuackInt x );
+  // Sets `is_root[i]` to whether the polynomial is zero at `xs[i]`, evaluating several points at once
+  void eval_many( std::span<const uint32_t> xs, std::span<bool> is_root ) const;
 
   friend std::ostream& operator<<( std::ostream& stream, const Polynomial& obj )
   {
@@ -0,0 +1,125 @@
+#include "quack_decoder.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+QuackDecoder::QuackDecoder( size_t threshold, bool checksum )
+  : threshold_( threshold )
+  , checksum_( checksum )
+  , num_sums_( threshold + ( checksum ? 1 : 0 ) )
+  , difference_( num_sums_ )
+  , polynomial_( threshold )
+{
+  if ( threshold > MAX_THRESHOLD ) {
+    throw std::runtime_error( "QuackDecoder supports thresholds up to " + std::to_string( MAX_THRESHOLD ) );
+  }
+
+  // Room for one root more than the threshold, so finding too many doesn't reallocate before it is noticed
+  missing_.reserve( threshold + 1 );
+
+  // Lists are only sent while they are shorter than the power sums
+  sorted_ids_.reserve( num_sums_ );
+}
+
+std::optional<std::span<const uint32_t>> QuackDecoder::decode( const PowerSums& sent,
+                                                               const Quack& quack,
+                                                               std::span<const uint32_t> candidates )
+{
+  auto start = std::chrono::steady_clock::now();
+
+  if ( sent.size() != num_sums_ || !accepts( quack ) ) {
+    throw std::runtime_error( "QuackDecoder::decode() called with the wrong number of power sums" );
+  }
+
+  missing_.clear();
+  last_failure_ = Failure::None;
+
+  // The proxy can't have more ids than were sent, and can't be missing more than the sums can solve for
+  if ( quack.num_received > sent.count() ) {
+    last_failure_ = Failure::Inconsistent;
+  } else if ( sent.count() - quack.num_received > quack.threshold ) {
+    last_failure_ = Failure::Overflow;
+  } else {
+    size_t num_missing = sent.count() - quack.num_received;
+    sent.difference( quack.power_sums, difference_ );
+    polynomial_.assign( difference_, num_missing, INVERSES );
+
+    for ( size_t offset = 0; offset < candidates.size() && missing_.size() <= num_missing; offset += EVAL_CHUNK ) {
+      auto chunk = candidates.subspan( offset, std::min( EVAL_CHUNK, candidates.size() - offset ) );
+      polynomial_.eval_many( chunk, is_root_ );
+
+      for ( size_t i = 0; i < chunk.size() && missing_.size() <= num_missing; i++ ) {
+        // A retransmitted id can appear in the window twice, but it only went missing once
+        if ( is_root_[i] && std::find( missing_.begin(), missing_.end(), chunk[i] ) == missing_.end() ) {
+          missing_.push_back( chunk[i] );
+        }
+      }
+    }
+
+    if ( missing_.size() != num_missing || !missing_explains_difference( quack.power_sums.size() ) ) {
+      last_failure_ = Failure::Inconsistent;
+    }
+  }
+
+  last_decode_time_ = std::chrono::steady_clock::now() - start;
+  if ( last_failure_ != Failure::None ) {
+    return {};
+  }
+  return missing_;
+}
+
+std::optional<std::span<const uint32_t>> QuackDecoder::decode_list( const PowerSums& sent,
+                                                                    const Quack& quack,
+                                                                    std::span<const uint32_t> candidates )
+{
+  auto start = std::chrono::steady_clock::now();
+
+  if ( quack.encoding != QuackEncoding::IdList ) {
+    throw std::runtime_error( "QuackDecoder::decode_list() called with a quACK that isn't an id list" );
+  }
+
+  sorted_ids_.assign( quack.received_ids.begin(), quack.received_ids.end() );
+  std::sort( sorted_ids_.begin(), sorted_ids_.end() );
+
+  missing_.clear();
+  for ( const uint32_t id : candidates ) {
+    if ( !std::binary_search( sorted_ids_.begin(), sorted_ids_.end(), id )
+         && std::find( missing_.begin(), missing_.end(), id ) == missing_.end() ) {
+      missing_.push_back( id );
+    }
+  }
+
+  // Every id the proxy is missing should be one we just compared against the list
+  last_failure_ = Failure::None;
+  if ( quack.num_received > sent.count() || sent.count() - quack.num_received != missing_.size() ) {
+    last_failure_ = Failure::Inconsistent;
+  }
+
+  last_decode_time_ = std::chrono::steady_clock::now() - start;
+  if ( last_failure_ != Failure::None ) {
+    return {};
+  }
+  return missing_;
+}
+
+// Whether the power sums of the decoded ids match the first `num_sums` sums in the difference, including those
+// past the degree of the polynomial that produced them
+bool QuackDecoder::missing_explains_difference( size_t num_sums )
+{
+  std::fill( missing_sums_.begin(), missing_sums_.begin() + num_sums, 0 );
+  for ( const uint32_t id : missing_ ) {
+    QuackInt power = id;
+    for ( size_t i = 0; i < num_sums; i++ ) {
+      missing_sums_[i] += power;
+      power *= id;
+    }
+  }
+
+  for ( size_t i = 0; i < num_sums; i++ ) {
+    if ( missing_sums_[i] != difference_[i] ) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "quack.hh"
+#include "sidekick_protocol.hh"
+
+// Turns the sender's power sums and a received quACK into the ids that went missing. All scratch space is
+// allocated up front, so decoding a quACK never touches the heap (except to hold more missing ids from an id list
+// than any list before it).
+//
+// A decode is only trusted if it finds exactly as many ids as went missing and their power sums reproduce every
+// sum in the quACK. With a checksum, the quACK carries one sum beyond the threshold, so this still catches a bad
+// decode when the threshold is exactly full.
+//
+// The proxy may lower a flow's threshold to save bandwidth, so a decoder takes quACKs with any threshold up to its
+// own, using the first sums of the sender's.
+class QuackDecoder
+{
+public:
+  static constexpr size_t MAX_THRESHOLD = 256;
+
+  // Why the last call to `decode()` gave up
+  enum class Failure
+  {
+    None,
+    Overflow,     // More ids went missing than the threshold allows
+    Inconsistent, // The roots don't explain the difference, e.g. reordering or an id the sender doesn't know
+  };
+
+private:
+  // Candidates are evaluated in chunks of this many ids, so the root mask has a fixed size
+  static constexpr size_t EVAL_CHUNK = 256;
+
+  // INVERSES[i] = 1/i, from 1/i = -(P / i) * 1/(P mod i) (mod P)
+  static constexpr std::array<QuackInt, MAX_THRESHOLD + 1> INVERSES = [] {
+    std::array<QuackInt, MAX_THRESHOLD + 1> inverses {};
+    inverses[1] = 1;
+    for ( size_t i = 2; i <= MAX_THRESHOLD; i++ ) {
+      inverses[i] = QuackInt( QuackInt::MODULUS - QuackInt::MODULUS / i ) * inverses[QuackInt::MODULUS % i];
+    }
+    return inverses;
+  }();
+
+  size_t threshold_;
+  bool checksum_;
+  size_t num_sums_;
+
+  // Scratch space reused by every call to `decode()`
+  PowerSums difference_;
+  Polynomial polynomial_;
+  std::array<bool, EVAL_CHUNK> is_root_ {};
+  std::vector<uint32_t> missing_ {};
+  std::array<QuackInt, MAX_THRESHOLD + 1> missing_sums_ {};
+  std::vector<uint32_t> sorted_ids_ {};
+
+  Failure last_failure_ { Failure::None };
+  std::chrono::nanoseconds last_decode_time_ {};
+
+  bool missing_explains_difference( size_t num_sums );
+
+public:
+  explicit QuackDecoder( size_t threshold, bool checksum = false );
+
+  // Find the ids in `candidates` that are accounted for in `sent` but not in `quack`, or nothing if they can't
+  // be trusted (see `last_failure()`). The returned span points into the decoder and is only valid until the
+  // next call.
+  std::optional<std::span<const uint32_t>> decode( const PowerSums& sent,
+                                                   const Quack& quack,
+                                                   std::span<const uint32_t> candidates );
+
+  // Same for a quACK with the `IdList` encoding: the missing ids are the candidates that aren't listed. `sent` must
+  // already include the candidates, and is only used to check the result against the quACK's count.
+  std::optional<std::span<const uint32_t>> decode_list( const PowerSums& sent,
+                                                        const Quack& quack,
+                                                        std::span<const uint32_t> candidates );
+
+  size_t threshold() const { return threshold_; }
+
+  // Number of power sums a quACK at the highest threshold carries: the threshold, plus one with a checksum
+  size_t num_sums() const { return num_sums_; }
+
+  // Number of power sums a quACK with the given threshold carries
+  size_t num_sums( size_t threshold ) const { return threshold + ( checksum_ ? 1 : 0 ); }
+
+  // Whether quACKs like `quack` can be decoded here
+  bool accepts( const Quack& quack ) const
+  {
+    return quack.threshold <= threshold_ && quack.power_sums.size() == num_sums( quack.threshold );
+  }
+
+  Failure last_failure() const { return last_failure_; }
+
+  // How long the last call to `decode()` took
+  std::chrono::nanoseconds last_decode_time() const { return last_decode_time_; }
+};
@@ -0,0 +1,69 @@
+#include "runtime.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "cli11.hh"
+
+void set_busy_poll( int fd, std::chrono::microseconds budget )
+{
+  int usecs = budget.count();
+  if ( setsockopt( fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof( usecs ) ) < 0 ) {
+    throw std::runtime_error( "setsockopt(SO_BUSY_POLL) failed: " + std::string( strerror( errno ) ) );
+  }
+}
+
+void Runtime::add_options( CLI::App& app, const std::string& roles )
+{
+  app.add_option( "--pin", pins_, "Pin a thread to a CPU, as role=cpu (roles: " + roles + ")" );
+  app.add_option( "--fifo-priority", fifo_priority_, "SCHED_FIFO priority for each role's thread, 0 for off" )
+    ->check( CLI::Range( 0, 99 ) )
+    ->capture_default_str();
+  app.add_flag( "--mlock", lock_memory_, "Lock all memory so page faults never stall a thread" );
+  app.add_option( "--spin-us", spin_us_, "Spin on queues and sockets for this long before blocking" )
+    ->capture_default_str();
+  app.add_option( "--busy-poll-us", busy_poll_us_, "Kernel busy-poll time for sockets (SO_BUSY_POLL)" )
+    ->capture_default_str();
+}
+
+void Runtime::start()
+{
+  for ( const auto& pin : pins_ ) {
+    auto separator = pin.find( '=' );
+    if ( separator == std::string::npos || separator == 0 || separator + 1 == pin.size() ) {
+      throw std::runtime_error( "Expected role=cpu, got " + pin );
+    }
+    cpus_[pin.substr( 0, separator )] = std::stoi( pin.substr( separator + 1 ) );
+  }
+
+  if ( lock_memory_ && mlockall( MCL_CURRENT | MCL_FUTURE ) < 0 ) {
+    throw std::runtime_error( "mlockall() failed: " + std::string( strerror( errno ) ) );
+  }
+}
+
+void Runtime::enter_thread( const std::string& role ) const
+{
+  auto it = cpus_.find( role );
+  if ( it != cpus_.end() ) {
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    CPU_SET( it->second, &cpus );
+    if ( int err = pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus ); err != 0 ) {
+      throw std::runtime_error( "Unable to pin " + role + " thread to CPU " + std::to_string( it->second ) + ": "
+                                + strerror( err ) );
+    }
+  }
+
+  if ( fifo_priority_ > 0 ) {
+    sched_param param { .sched_priority = fifo_priority_ };
+    if ( int err = pthread_setschedparam( pthread_self(), SCHED_FIFO, &param ); err != 0 ) {
+      throw std::runtime_error( "Unable to set SCHED_FIFO for " + role + " thread: " + strerror( err ) );
+    }
+  }
+}
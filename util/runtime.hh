@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CLI {
+class App;
+}
+
+// Hint to the CPU that we're in a spin loop, so it can save power and let a sibling hyperthread run
+inline void cpu_relax()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+  __builtin_ia32_pause();
+#elif defined( __aarch64__ ) || defined( __arm__ )
+  asm volatile( "yield" );
+#endif
+}
+
+// Call `ready` until it returns true or `budget` has passed, and return its last answer. Used to catch work that
+// arrives shortly instead of paying for a sleep and wakeup in the kernel.
+template<typename Ready>
+bool spin_until( Ready&& ready, std::chrono::steady_clock::duration budget )
+{
+  if ( budget.count() <= 0 ) {
+    return ready();
+  }
+  auto deadline = std::chrono::steady_clock::now() + budget;
+  while ( !ready() ) {
+    if ( std::chrono::steady_clock::now() >= deadline ) {
+      return false;
+    }
+    cpu_relax();
+  }
+  return true;
+}
+
+// Have the kernel busy-poll the device queue for up to `budget` when a blocking read on `fd` finds nothing
+// (SO_BUSY_POLL). Raising it above net.core.busy_read needs CAP_NET_ADMIN.
+void set_busy_poll( int fd, std::chrono::microseconds budget );
+
+// Scheduling options for the threads whose wakeup latency delays recovery, shared by every binary. Each thread
+// has a role (e.g. "sender"), which can be pinned to a CPU.
+class Runtime
+{
+private:
+  std::vector<std::string> pins_ {};
+  std::unordered_map<std::string, int> cpus_ {};
+  int fifo_priority_ {};
+  bool lock_memory_ {};
+  uint64_t spin_us_ {};
+  uint64_t busy_poll_us_ {};
+
+public:
+  // Register --pin, --fifo-priority, --mlock, --spin-us and --busy-poll-us. `roles` lists the roles this binary
+  // has, for the help text.
+  void add_options( CLI::App& app, const std::string& roles );
+
+  // Check the options and lock memory if asked. Call once after parsing, before starting any threads.
+  void start();
+
+  // Apply the pinning and priority for `role` to the calling thread
+  void enter_thread( const std::string& role ) const;
+
+  // How long to spin on a queue or socket before blocking, and how long the kernel should busy-poll sockets
+  std::chrono::microseconds spin() const { return std::chrono::microseconds( spin_us_ ); }
+  std::chrono::microseconds busy_poll() const { return std::chrono::microseconds( busy_poll_us_ ); }
+};
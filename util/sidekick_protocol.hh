@@ -1,49 +1,221 @@
 // Sidekick protocol details
 #pragma once
 
+#include <algorithm>
 #include <optional>
+#include <span>
+#include <stdexcept>
+#include <vector>
 
 #include "parser.hh"
 #include "quack.hh"
 
 static constexpr uint16_t QUACK_LISTEN_PORT = 8765;
 
+// Largest quACK on the wire: the UDP payload of a 1500-byte IPv4 packet
+static constexpr size_t MAX_QUACK_SIZE = 1472;
+
 // Four bytes of UDP payload at `QUACK_ID_OFFSET` will be used as the opaque packet id
 static constexpr uint16_t QUACK_ID_OFFSET = 8;
 
+// How a quACK describes what the proxy received. Power sums have a fixed size however many packets are lost, but
+// can only solve for `threshold` of them. Right after power sums are sent, listing the few ids received since is
+// smaller, and exact for any number of losses.
+enum class QuackEncoding : uint8_t
+{
+  PowerSums, // Cumulative power sums over the epoch
+  IdList,    // Every id received since the last power sums in the epoch
+};
+
+// quACK state is reset every so often, so neither end keeps history forever. Each epoch starts from empty power
+// sums, and the sender can discard what it kept for the epoch before last once it sees a new one.
 struct Quack
 {
+  uint32_t epoch {};
+  QuackEncoding encoding { QuackEncoding::PowerSums };
+
+  // Most ids the power sums can solve for. The proxy picks it per flow, and only sends that many of the sums it
+  // keeps (plus one with a checksum), in `num_sums`.
+  uint16_t threshold {};
+  size_t num_sums {};
+
+  // Number of distinct ids folded into `power_sums`, so the sender can tell how many of its own are missing
   uint32_t num_received {};
   uint32_t last_received_id {};
+
+  // The last id received in the previous epoch; everything the sender sent after it belongs to this one
+  uint32_t epoch_boundary_id {};
+
   PowerSums power_sums { 0 };
 
+  // With `IdList`, the ids received since the last power sums, which covered `list_base_count` ids (0 if none
+  // have been sent this epoch)
+  uint32_t list_base_count {};
+  std::vector<uint32_t> received_ids {};
+
   void parse( Parser& parser )
   {
+    uint8_t encoding_tag;
+    parser.integer( epoch );
+    parser.integer( encoding_tag );
+    parser.integer( threshold );
     parser.integer( num_received );
     parser.integer( last_received_id );
+    parser.integer( epoch_boundary_id );
 
     uint32_t tmp;
-    std::vector<ModInt> sums {};
-    while ( !parser.buffer().empty() ) {
-      parser.integer( tmp );
-      sums.push_back( tmp );
+    switch ( encoding = static_cast<QuackEncoding>( encoding_tag ) ) {
+      case QuackEncoding::PowerSums: {
+        std::vector<QuackInt> sums {};
+        while ( !parser.buffer().empty() ) {
+          parser.integer( tmp );
+          sums.push_back( tmp );
+        }
+        num_sums = sums.size();
+        power_sums = { sums };
+        break;
+      }
+
+      case QuackEncoding::IdList:
+        parser.integer( list_base_count );
+        received_ids.clear();
+        while ( !parser.buffer().empty() ) {
+          parser.integer( tmp );
+          received_ids.push_back( tmp );
+        }
+        break;
+
+      default:
+        parser.set_error();
     }
 
-    power_sums = { sums };
+    // No receiver can decode against zero power sums
+    if ( threshold == 0 ) {
+      parser.set_error();
+    }
   }
 
-  void serialize( Serializer& serializer ) const
+  // Header plus whichever encoding is larger, for `num_sums` power sums
+  static constexpr size_t max_size( size_t num_sums ) { return 4 * 4 + 1 + 2 + 4 * ( num_sums + 1 ); }
+
+  template<class S>
+  void serialize( S& serializer ) const
   {
+    serializer.integer( epoch );
+    serializer.integer( static_cast<uint8_t>( encoding ) );
+    serializer.integer( threshold );
     serializer.integer( num_received );
     serializer.integer( last_received_id );
-    for ( size_t i = 0; i < power_sums.size(); i++ ) {
-      serializer.integer( power_sums[i].value() );
+    serializer.integer( epoch_boundary_id );
+
+    if ( encoding == QuackEncoding::IdList ) {
+      serializer.integer( list_base_count );
+      for ( uint32_t id : received_ids ) {
+        serializer.integer( id );
+      }
+    } else {
+      for ( size_t i = 0; i < num_sums; i++ ) {
+        serializer.integer( power_sums[i].value() );
+      }
+    }
+  }
+
+  // The same quACK as if sent with a lower threshold: only the first `sums` power sums
+  Quack truncated( uint16_t lower_threshold, size_t sums ) const
+  {
+    if ( lower_threshold == 0 ) {
+      throw std::runtime_error( "Quack::truncated() called with a threshold of 0" );
+    }
+    Quack quack = *this;
+    std::vector<QuackInt> prefix( sums );
+    for ( size_t i = 0; i < sums; i++ ) {
+      prefix[i] = power_sums[i];
+    }
+    quack.threshold = lower_threshold;
+    quack.num_sums = sums;
+    quack.power_sums = { prefix };
+    return quack;
+  }
+
+  // Note ids received since the last power sums, for the list. It stops growing at `max_sums`, the most sums the
+  // flow's quACKs can ever carry, as power sums are always chosen from there until they go out and the list starts
+  // over. A quACK held back for a while keeps taking ids in, and would otherwise keep them all.
+  void add_received_ids( std::span<const uint32_t> ids, size_t max_sums )
+  {
+    size_t room = max_sums - std::min( received_ids.size(), max_sums );
+    received_ids.insert( received_ids.end(), ids.begin(), ids.begin() + std::min( room, ids.size() ) );
+  }
+
+  // Pick the smaller encoding for the ids in `received_ids`. Once power sums are chosen, the list starts over.
+  void choose_encoding()
+  {
+    encoding = received_ids.size() < num_sums ? QuackEncoding::IdList : QuackEncoding::PowerSums;
+  }
+
+  // Call after sending, so the next list builds on what was just sent
+  void mark_sent()
+  {
+    if ( encoding == QuackEncoding::PowerSums ) {
+      list_base_count = num_received;
+      received_ids.clear();
+    }
+  }
+
+  // Start the next epoch right after the id most recently received
+  void next_epoch()
+  {
+    epoch++;
+    epoch_boundary_id = last_received_id;
+    num_received = 0;
+    power_sums.clear();
+    list_base_count = 0;
+    received_ids.clear();
+  }
+};
+
+// What a receiver saw of the quACKs for one of its flows, sent back to the proxy (from the quACK port to wherever
+// the quACKs came from) so it can adapt the flow's threshold and quACK interval. The flow is the one from the
+// feedback's source address and `src_port`, to `dst`:`dst_port`. Counts are since the previous feedback.
+struct QuackFeedback
+{
+  uint16_t src_port {};
+  uint32_t dst {};
+  uint16_t dst_port {};
+
+  uint32_t packets {};     // Packets sent
+  uint32_t missing {};     // Packets quACKs showed missing
+  uint32_t max_missing {}; // Most missing at any one quACK
+  uint32_t overflows {};   // QuACKs with more missing than their threshold
+
+  void parse( Parser& parser )
+  {
+    parser.integer( src_port );
+    parser.integer( dst );
+    parser.integer( dst_port );
+    parser.integer( packets );
+    parser.integer( missing );
+    parser.integer( max_missing );
+    parser.integer( overflows );
+    if ( !parser.buffer().empty() ) {
+      parser.set_error();
     }
   }
+
+  template<class S>
+  void serialize( S& serializer ) const
+  {
+    serializer.integer( src_port );
+    serializer.integer( dst );
+    serializer.integer( dst_port );
+    serializer.integer( packets );
+    serializer.integer( missing );
+    serializer.integer( max_missing );
+    serializer.integer( overflows );
+  }
 };
 
 // Get an opaque identifier from a UDP datagram at `QUACK_ID_OFFSET`
-std::optional<uint32_t> get_packet_id( std::string_view udp_payload )
+inline std::optional<uint32_t> get_packet_id( std::string_view udp_payload )
 {
   // Not enough data to grab a packet identifier
   if ( udp_payload.length() < QUACK_ID_OFFSET + sizeof( uint32_t ) ) {
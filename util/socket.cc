@@ -1,4 +1,8 @@
 #include "socket.hh"
+#include "runtime.hh"
+
+#include <cerrno>
+#include <cstring>
 
 UDPSocket::UDPSocket()
 {
@@ -26,6 +30,62 @@ void UDPSocket::sendto( std::string_view buf, const Address& address )
   }
 }
 
+void UDPSocket::queue_sendto( std::string_view buf, const Address& address )
+{
+  if ( buf.length() > BUFFER_LEN ) {
+    throw std::runtime_error( "Datagram too long to queue" );
+  }
+  if ( send_lengths_.size() == MAX_SEND_BATCH ) {
+    flush();
+  }
+  if ( send_buffer_.empty() ) {
+    send_buffer_.resize( BUFFER_LEN * MAX_SEND_BATCH );
+    send_lengths_.reserve( MAX_SEND_BATCH );
+    send_addresses_.reserve( MAX_SEND_BATCH );
+  }
+
+  memcpy( send_buffer_.data() + send_lengths_.size() * BUFFER_LEN, buf.data(), buf.length() );
+  send_lengths_.push_back( buf.length() );
+  send_addresses_.push_back( address );
+}
+
+size_t UDPSocket::flush()
+{
+  size_t count = send_lengths_.size();
+  if ( count == 0 ) {
+    return 0;
+  }
+
+  iovec iovs[MAX_SEND_BATCH];
+  mmsghdr msgs[MAX_SEND_BATCH] {};
+  for ( size_t i = 0; i < count; i++ ) {
+    iovs[i] = { send_buffer_.data() + i * BUFFER_LEN, send_lengths_[i] };
+    msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>( send_addresses_[i].raw() );
+    msgs[i].msg_hdr.msg_namelen = send_addresses_[i].size();
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // The kernel may stop partway, e.g. when interrupted
+  size_t sent = 0;
+  while ( sent < count ) {
+    int n = ::sendmmsg( fd, msgs + sent, count - sent, 0 );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n <= 0 ) {
+      send_lengths_.clear();
+      send_addresses_.clear();
+      throw std::runtime_error( "sendmmsg() failed" );
+    }
+    sent += n;
+  }
+
+  send_lengths_.clear();
+  send_addresses_.clear();
+  return count;
+}
+
 Address UDPSocket::recvfrom( std::string& buf )
 {
   buf.clear();
@@ -34,11 +94,53 @@ Address UDPSocket::recvfrom( std::string& buf )
   Address::Raw saddr;
   socklen_t saddr_len = sizeof( saddr );
 
-  ssize_t len;
-  if ( ( len = ::recvfrom( fd, buf.data(), buf.size(), 0, saddr, &saddr_len ) ) < 0 ) {
+  // Try without blocking for a while first, if asked to. Otherwise it's a single blocking call.
+  ssize_t len = -1;
+  bool done = false;
+  if ( spin_.count() > 0 ) {
+    done = spin_until(
+      [&] {
+        saddr_len = sizeof( saddr );
+        len = ::recvfrom( fd, buf.data(), buf.size(), MSG_DONTWAIT, saddr, &saddr_len );
+        return len >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK );
+      },
+      spin_ );
+  }
+
+  if ( !done ) {
+    saddr_len = sizeof( saddr );
+    len = ::recvfrom( fd, buf.data(), buf.size(), 0, saddr, &saddr_len );
+  }
+  if ( len < 0 ) {
     throw std::runtime_error( "recvfrom() failed" );
   }
   buf.resize( len );
 
   return { saddr, saddr_len };
+}
+
+std::optional<Address> UDPSocket::try_recvfrom( std::string& buf )
+{
+  buf.clear();
+  buf.resize( BUFFER_LEN );
+
+  Address::Raw saddr;
+  socklen_t saddr_len = sizeof( saddr );
+  ssize_t len = ::recvfrom( fd, buf.data(), buf.size(), MSG_DONTWAIT, saddr, &saddr_len );
+  if ( len < 0 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) {
+      return {};
+    }
+    throw std::runtime_error( "recvfrom() failed" );
+  }
+  buf.resize( len );
+
+  return Address( saddr, saddr_len );
+}
+
+void UDPSocket::set_busy_poll( std::chrono::microseconds budget )
+{
+  if ( budget.count() > 0 ) {
+    ::set_busy_poll( fd, budget );
+  }
 }
\ No newline at end of file
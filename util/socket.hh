@@ -1,5 +1,10 @@
 #pragma once
 
+#include <chrono>
+#include <optional>
+#include <string_view>
+#include <vector>
+
 #include <sys/socket.h>
 
 #include "address.hh"
@@ -11,11 +16,36 @@ private:
   int fd;
   static constexpr size_t BUFFER_LEN = 1500;
 
+  // How long recvfrom() polls without blocking before it sleeps
+  std::chrono::steady_clock::duration spin_ {};
+
+  // Datagrams queued by queue_sendto() for the next flush(), each in its own BUFFER_LEN slice of `send_buffer_`
+  static constexpr size_t MAX_SEND_BATCH = 64;
+  std::vector<char> send_buffer_ {};
+  std::vector<size_t> send_lengths_ {};
+  std::vector<Address> send_addresses_ {};
+
 public:
   UDPSocket();
   ~UDPSocket();
 
   void bind( const Address& address );
   void sendto( std::string_view buf, const Address& address );
+
+  // Copy a datagram to be sent by the next flush(), along with everything else queued, in one sendmmsg() call.
+  // Flushes first if the batch is full.
+  void queue_sendto( std::string_view buf, const Address& address );
+
+  // Send every queued datagram. Returns how many there were.
+  size_t flush();
+  size_t queued() const { return send_lengths_.size(); }
   Address recvfrom( std::string& buf );
+
+  // Like recvfrom(), but returns nothing rather than wait if no datagram is queued
+  std::optional<Address> try_recvfrom( std::string& buf );
+
+  void set_spin( std::chrono::steady_clock::duration spin ) { spin_ = spin; }
+
+  // Have the kernel busy-poll for incoming packets, if `budget` isn't zero
+  void set_busy_poll( std::chrono::microseconds budget );
 };
\ No newline at end of file
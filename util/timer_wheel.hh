@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS slots, where each slot of a level spans a whole turn of the
+// level below. Scheduling is O(1) and expiring costs O(1) per timer however many are pending, since timers only
+// move down a level (at most LEVELS - 1 times) as their time gets close. Timers fire in the tick they are due, or
+// the first advance() after it; never early. Timers are not cancelled: owners check whether one is still wanted
+// when it fires.
+template<typename Key>
+class TimerWheel
+{
+private:
+  static constexpr unsigned SLOT_BITS = 6;
+  static constexpr uint64_t SLOTS = uint64_t { 1 } << SLOT_BITS;
+  static constexpr size_t LEVELS = 4;
+
+  // Ticks covered by the whole wheel; later timers wait in the top level and are placed again as it turns
+  static constexpr uint64_t HORIZON = uint64_t { 1 } << ( SLOT_BITS * LEVELS );
+
+  struct Timer
+  {
+    Key key;
+    uint64_t expires;
+  };
+
+  std::chrono::steady_clock::duration tick_;
+  std::chrono::steady_clock::time_point start_;
+
+  // Every tick before this one has been processed
+  uint64_t current_tick_ {};
+
+  std::array<std::array<std::vector<Timer>, SLOTS>, LEVELS> slots_ {};
+  size_t size_ {};
+
+  // Slots are swapped out into these before their timers are placed again, so the buffers get reused
+  std::vector<Timer> cascading_ {};
+  std::vector<Timer> due_ {};
+
+  void insert( const Timer& timer )
+  {
+    uint64_t delta = std::min( timer.expires - current_tick_, HORIZON - 1 );
+    size_t level = 0;
+    while ( delta >= ( uint64_t { 1 } << ( SLOT_BITS * ( level + 1 ) ) ) ) {
+      level++;
+    }
+    uint64_t placed_at = current_tick_ + delta;
+    slots_[level][( placed_at >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 )].push_back( timer );
+  }
+
+  // Move the timers in the slot of `level` that starts now down to the levels below
+  void cascade( size_t level )
+  {
+    cascading_.swap( slots_[level][( current_tick_ >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 )] );
+    for ( const auto& timer : cascading_ ) {
+      insert( timer );
+    }
+    cascading_.clear();
+  }
+
+public:
+  TimerWheel( std::chrono::steady_clock::duration tick, std::chrono::steady_clock::time_point start )
+    : tick_( tick ), start_( start )
+  {}
+
+  std::chrono::steady_clock::duration tick() const { return tick_; }
+  size_t size() const { return size_; }
+
+  // Fire `key` once `when` has passed
+  void schedule( const Key& key, std::chrono::steady_clock::time_point when )
+  {
+    // Round up, so a timer never fires before it is due
+    uint64_t expires = when <= start_ ? 0 : ( when - start_ + tick_ - std::chrono::nanoseconds( 1 ) ) / tick_;
+    insert( { key, std::max( expires, current_tick_ ) } );
+    size_++;
+  }
+
+  // Call `on_expire` with the key of every timer due by `now`. It may schedule more timers.
+  template<typename F>
+  void advance( std::chrono::steady_clock::time_point now, F&& on_expire )
+  {
+    if ( now < start_ ) {
+      return;
+    }
+    uint64_t target = ( now - start_ ) / tick_;
+
+    while ( current_tick_ <= target ) {
+      // Nothing can fire before the target, so skip straight there
+      if ( size_ == 0 ) {
+        current_tick_ = target + 1;
+        return;
+      }
+
+      for ( size_t level = 1; level < LEVELS; level++ ) {
+        if ( ( current_tick_ >> ( SLOT_BITS * ( level - 1 ) ) ) & ( SLOTS - 1 ) ) {
+          break;
+        }
+        cascade( level );
+      }
+
+      due_.swap( slots_[0][current_tick_ & ( SLOTS - 1 )] );
+      uint64_t tick = current_tick_++;
+
+      for ( const auto& timer : due_ ) {
+        if ( timer.expires <= tick ) {
+          size_--;
+          on_expire( timer.key );
+        } else {
+          insert( timer );
+        }
+      }
+      due_.clear();
+    }
+  }
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+// Rate limiter: tokens build up at `rate` a second, to at most `burst`, and each use spends some. Starts full. A
+// bucket left alone for refill_time() is full again, so it is no different from a new one.
+class TokenBucket
+{
+private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  std::chrono::steady_clock::time_point refilled_at_;
+
+  void refill( std::chrono::steady_clock::time_point now )
+  {
+    if ( now > refilled_at_ ) {
+      tokens_ = std::min( burst_, tokens_ + rate_ * std::chrono::duration<double>( now - refilled_at_ ).count() );
+      refilled_at_ = now;
+    }
+  }
+
+public:
+  TokenBucket( double rate, double burst, std::chrono::steady_clock::time_point now )
+    : rate_( rate ), burst_( burst ), tokens_( burst ), refilled_at_( now )
+  {
+    if ( rate <= 0 || burst <= 0 ) {
+      throw std::runtime_error( "TokenBucket needs a positive rate and burst" );
+    }
+  }
+
+  // Whether `tokens` could be spent at `now`
+  bool has( double tokens, std::chrono::steady_clock::time_point now )
+  {
+    refill( now );
+    return tokens_ >= tokens;
+  }
+
+  // Spend tokens that has() just said were there
+  void take( double tokens ) { tokens_ -= tokens; }
+
+  std::chrono::steady_clock::duration refill_time() const
+  {
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>( burst_ / rate_ ) );
+  }
+};